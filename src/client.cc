@@ -1,11 +1,21 @@
 #include "server.h"
 
+int nclients = 0;
+client *clients = NULL;
+
 client *client_new(){
 	client *c = (client*)calloc(1, sizeof(client));
 	if (!c){
 		err(1, "malloc");
 	}
+	nclients++;
+	c->next = clients;
+	if (clients){
+		clients->prev = c;
+	}
+	clients = c;
 	c->worker.data = c; // self reference
+	c->req.data = c;
 	return c;
 }
 
@@ -28,7 +38,18 @@ void client_free(client *c){
 	if (c->tmp_err){
 		free(c->tmp_err);
 	}
+	multi_free(c);
+	client_memory -= c->buf_cap+c->output_cap;
+	if (c->prev){
+		c->prev->next = c->next;
+	}else{
+		clients = c->next;
+	}
+	if (c->next){
+		c->next->prev = c->prev;
+	}
 	free(c);
+	nclients--;
 }
 
 void on_close(uv_handle_t *stream){
@@ -36,11 +57,34 @@ void on_close(uv_handle_t *stream){
 }
 
 void client_close(client *c){
-	uv_close((uv_handle_t *)&c->tcp, on_close);
+	if (!c->uring && uv_is_closing(&c->handle)){
+		return;
+	}
+	if (c->stalled){
+		stall_remove(c);
+	}
+	if (c->yielded){
+		sched_remove(c);
+	}
+	if (c->primary || c->replica){
+		repl_close(c);
+	}
+	if (c->uring){
+		uring_close(c);
+		return;
+	}
+	uv_close(&c->handle, on_close);
 }
-inline void client_output_require(client *c, size_t siz){
-	if (c->output_cap < siz){
-		while (c->output_cap < siz){
+// client_output_require makes room for siz bytes of output. Returns false
+// when the client went over the output limit, its output is dropped and the
+// client is closed after the command.
+static bool client_output_require(client *c, size_t siz){
+	if (c->overlimit || !memory_output_allowed(c, siz)){
+		return false;
+	}
+	if ((size_t)c->output_cap < siz){
+		int cap = c->output_cap;
+		while ((size_t)c->output_cap < siz){
 			if (c->output_cap == 0){
 				c->output_cap = 1;
 			}else{
@@ -51,21 +95,32 @@ inline void client_output_require(client *c, size_t siz){
 		if (!c->output){
 			err(1, "malloc");
 		}
+		client_memory += c->output_cap-cap;
 	}
+	return true;
 }
 void client_write(client *c, const char *data, int n){
-	client_output_require(c, c->output_len+n);
+	if (!client_output_require(c, c->output_len+n)){
+		return;
+	}
 	memcpy(c->output+c->output_len, data, n);	
 	c->output_len+=n;
 }
 
 void client_clear(client *c){
+	if (c->writing){
+		// the output buffer is still being written, new replies are
+		// appended after it.
+		return;
+	}
 	c->output_len = 0;
 	c->output_offset = 0;
 }
 
 void client_write_byte(client *c, char b){
-	client_output_require(c, c->output_len+1);
+	if (!client_output_require(c, c->output_len+1)){
+		return;
+	}
 	c->output[c->output_len++] = b;
 }
 
@@ -84,29 +139,96 @@ void client_write_multibulk(client *c, int n){
 	client_write(c, h, strlen(h));
 }
 
-void client_write_int(client *c, int n){
+void client_write_int(client *c, long long n){
 	char h[32];
-	sprintf(h, ":%d\r\n", n);
+	sprintf(h, ":%lld\r\n", n);
 	client_write(c, h, strlen(h));
 }
 
 void client_write_error(client *c, error err){
-	client_write(c, "-ERR ", 5);
+	if (err == ERR_WRONGTYPE){
+		// carries its own error code.
+		client_write_byte(c, '-');
+	}else{
+		client_write(c, "-ERR ", 5);
+	}
 	client_write(c, err, strlen(err));
 	client_write_byte(c, '\r');
 	client_write_byte(c, '\n');
 }
 
 
+static void on_write(uv_write_t *req, int status){
+	client_write_done((client*)req->data, status);
+}
+
+// client_write_done is called when the write of the output buffer finished.
+void client_write_done(client *c, int status){
+	int written = c->writing;
+	c->writing = 0;
+	if (status < 0){
+		if (c->throttled){
+			// paused, nothing else notices that the connection is gone.
+			client_close(c);
+		}
+		return;
+	}
+	// move the replies that were added during the write to the front.
+	memmove(c->output, c->output+written, c->output_len-written);
+	c->output_len -= written;
+	c->output_offset = 0;
+	client_flush(c);
+	if (c->throttled){
+		c->throttled = 0;
+		client_resume(c);
+	}else{
+		client_trim(c);
+	}
+}
+
+// client_trim frees buffers that grew large and are empty again, so that a
+// client that once read or wrote a lot doesn't hold on to the memory.
+void client_trim(client *c){
+	if (c->buf_len == 0 && c->buf_cap > CLIENT_BUF_KEEP && !c->blocked){
+		client_memory -= c->buf_cap;
+		free(c->buf);
+		c->buf = NULL;
+		c->buf_cap = 0;
+		c->buf_idx = 0;
+	}
+	if (c->output_len == 0 && !c->writing && c->output_cap > CLIENT_BUF_KEEP){
+		client_memory -= c->output_cap;
+		free(c->output);
+		c->output = NULL;
+		c->output_cap = 0;
+	}
+}
+
+// client_flush_offset writes the output buffer starting at offset. Only one
+// write is in flight at a time. Output added while writing is flushed once
+// the write completes.
 void client_flush_offset(client *c, int offset){
+	if (c->writing || c->overlimit){
+		return;
+	}
 	if (c->output_len-offset <= 0){
+		c->output_len = 0;
+		c->output_offset = 0;
 		return;
 	}
-	uv_buf_t buf = {0};
+	uv_buf_t buf;
 	buf.base = c->output+offset;
 	buf.len = c->output_len-offset;
-	uv_write(&c->req, (uv_stream_t *)&c->tcp, &buf, 1, NULL);
-	c->output_len = 0;
+	c->writing = c->output_len;
+	if (c->uring){
+		uring_write(c, buf.base, buf.len);
+		return;
+	}
+	if (uv_write(&c->req, &c->stream, &buf, 1, on_write)){
+		c->writing = 0;
+		c->output_len = 0;
+		c->output_offset = 0;
+	}
 }
 
 
@@ -139,6 +261,14 @@ error client_err_unknown_command(client *c, const char *name, int count){
 	strcat(c->tmp_err, "'");
 	return c->tmp_err;
 }
+error client_err_inside_multi(client *c, const char *name, int count){
+	client_err_alloc(c, count+64);
+	c->tmp_err[0] = 0;
+	strcat(c->tmp_err, "'");
+	strncat(c->tmp_err, name, count);
+	strcat(c->tmp_err, "' inside MULTI is not allowed");
+	return c->tmp_err;
+}
 void client_append_arg(client *c, const char *data, int nbyte){
 	if (c->args_cap==c->args_len){
 		if (c->args_cap==0){
@@ -282,7 +412,7 @@ error client_read_command(client *c){
 					}
 				}
 				i++;
-				if (z-i < nsiz+2){
+				if (z-i < (size_t)nsiz+2){
 					return ERR_INCOMPLETE;
 				}
 				s = i;
@@ -297,6 +427,10 @@ error client_read_command(client *c){
 				break;
 			}
 		}
+		if (c->args_len != j+1){
+			// the bulk length line is not complete yet.
+			return ERR_INCOMPLETE;
+		}
 	}
 	c->buf_len -= i-c->buf_idx;
 	if (c->buf_len == 0){
@@ -320,7 +454,19 @@ void client_print_args(client *c){
 }
 
 bool client_exec_commands(client *c){
-	for (;;){
+	uint64_t start = uv_hrtime();
+	for (int n=1;;n++){
+		if (c->overlimit){
+			return false;
+		}
+		if (memory_throttle(c)){
+			// goes on when the replies are written.
+			c->throttled = 1;
+			client_pause(c);
+			return true;
+		}
+		int buf_idx = c->buf_idx;
+		int buf_len = c->buf_len;
 		error err = client_read_command(c);
 		if (err != NULL){
 			if ((char*)err == (char*)ERR_INCOMPLETE){
@@ -329,14 +475,37 @@ bool client_exec_commands(client *c){
 			client_write_error(c, err);
 			return false;
 		}
-		err = exec_command(c);
+		const command *cmd;
+		if (c->primary){
+			cmd = repl_lookup_command(c);
+		}else{
+			cmd = lookup_command(c);
+		}
+		if (!stall_admit(c, cmd)){
+			// put the command back, it runs once the client is resumed.
+			c->buf_idx = buf_idx;
+			c->buf_len = buf_len;
+			return true;
+		}
+		err = exec_command(c, cmd);
 		if (err != NULL){
 			if (err == ERR_QUIT){
 				return false;
 			}
+			if (c->primary){
+				log('#', "Replication error: %s", err);
+				return false;
+			}
 			client_write_error(c, err);
 			return true;
 		}
+		if (c->blocked){
+			return true;
+		}
+		if (c->buf_len && sched_turn_over(c, n, start)){
+			sched_yield(c);
+			return true;
+		}
 	}
 	return true;
 }
@@ -0,0 +1,183 @@
+#include "server.h"
+#include <rocksdb/rate_limiter.h>
+#include <atomic>
+
+// With --rate-limit, flushes and compactions of all shards share one RocksDB
+// rate limiter, so their bursts don't take the whole disk away from reads.
+// With --rate-limit-auto the limit moves between a twentieth of the given
+// rate and the rate itself: up by a quarter when the background writes used
+// up most of it in the last second, down by a tenth when they used less than
+// half, and straight to the top when writes are stalled. RocksDB 4.13 has no
+// auto-tuned limiter, so the timer does it.
+int64_t rate_limit = 0;
+bool rate_limit_auto = false;
+
+static std::shared_ptr<rocksdb::RateLimiter> limiter;
+static int64_t rate_current = 0;
+static int64_t rate_through = 0;
+static uv_timer_t rate_timer;
+
+// COMPACT runs CompactRange on every shard on the thread pool, the progress
+// is in the compaction section of INFO.
+typedef struct compact_job_t {
+	uv_work_t req;
+	bool range;
+	std::string start;
+	std::string end;
+	std::atomic<int> done;	// column families compacted so far
+	int total;
+	uint64_t started;
+	rocksdb::Status status;
+} compact_job;
+
+static compact_job *compact_current = NULL;
+static const char *lastcompact_status = "none";
+static uint64_t lastcompact_duration_ms = 0;
+static uint64_t compactions = 0;
+
+bool compact_in_progress(){
+	return compact_current != NULL;
+}
+
+void compact_options(rocksdb::Options *options){
+	if (rate_limit <= 0){
+		return;
+	}
+	if (!limiter){
+		rate_current = rate_limit_auto ? rate_limit/20 : rate_limit;
+		if (rate_current <= 0){
+			rate_current = 1;
+		}
+		limiter.reset(rocksdb::NewGenericRateLimiter(rate_current));
+	}
+	options->rate_limiter = limiter;
+}
+
+static void on_rate_timer(uv_timer_t *){
+	int64_t through = limiter->GetTotalBytesThrough();
+	int64_t used = through-rate_through;
+	rate_through = through;
+	int64_t rate = rate_current;
+	if (stall_state != STALL_NONE || used >= rate/10*9){
+		rate = stall_state != STALL_NONE ? rate_limit : rate+rate/4;
+	}else if (used < rate/2){
+		rate -= rate/10;
+	}
+	if (rate > rate_limit){
+		rate = rate_limit;
+	}
+	if (rate < rate_limit/20){
+		rate = rate_limit/20;
+	}
+	if (rate > 0 && rate != rate_current){
+		rate_current = rate;
+		limiter->SetBytesPerSecond(rate);
+	}
+}
+
+void compact_init(){
+	if (!limiter || !rate_limit_auto){
+		return;
+	}
+	uv_timer_init(loop, &rate_timer);
+	uv_timer_start(&rate_timer, on_rate_timer, 1000, 1000);
+}
+
+static void on_compact_work(uv_work_t *req){
+	compact_job *job = (compact_job*)req->data;
+	rocksdb::CompactRangeOptions options;
+	// automatic compactions go on, or writes could stall behind this one.
+	options.exclusive_manual_compaction = false;
+	rocksdb::Slice start(job->start), end(job->end);
+	for (int i=0;i<nshards && job->status.ok();i++){
+		job->status = shards[i].db->CompactRange(options,
+			job->range ? &start : NULL, job->range ? &end : NULL);
+		job->done++;
+		if (job->status.ok() && !job->range){
+			job->status = shards[i].db->CompactRange(options,
+				shards[i].hashcf, NULL, NULL);
+			job->done++;
+		}
+	}
+}
+
+static void on_compact_work_done(uv_work_t *req, int){
+	compact_job *job = (compact_job*)req->data;
+	compact_current = NULL;
+	lastcompact_duration_ms = uv_now(loop)-job->started;
+	if (job->status.ok()){
+		lastcompact_status = "ok";
+		compactions++;
+		log('*', "Compaction done in %llu ms",
+			(unsigned long long)lastcompact_duration_ms);
+	}else{
+		lastcompact_status = "err";
+		log('#', "Compaction failed: %s", job->status.ToString().c_str());
+	}
+	delete job;
+}
+
+error exec_compact(client *c){
+	if (c->args_len!=1 && c->args_len!=3){
+		return "wrong number of arguments for 'compact' command";
+	}
+	if (compact_current){
+		return "Compaction already in progress";
+	}
+	compact_job *job = new compact_job();
+	job->req.data = job;
+	job->range = c->args_len==3;
+	if (job->range){
+		job->start.assign(c->args[1], c->args_size[1]);
+		job->end.assign(c->args[2], c->args_size[2]);
+	}
+	job->done = 0;
+	job->total = job->range ? nshards : nshards*2;
+	job->started = uv_now(loop);
+	compact_current = job;
+	log('*', "Compaction started");
+	uv_queue_work(loop, &job->req, on_compact_work, on_compact_work_done);
+	client_write(c, "+Background compaction started\r\n", 32);
+	return NULL;
+}
+
+void compact_info(std::string *out){
+	uint64_t pending = 0;
+	int running = 0;
+	for (int i=0;i<nshards;i++){
+		uint64_t n;
+		if (shards[i].db->GetIntProperty("rocksdb.estimate-pending-compaction-bytes", &n)){
+			pending += n;
+		}
+		if (shards[i].db->GetIntProperty("rocksdb.compaction-pending", &n)){
+			running += n ? 1 : 0;
+		}
+	}
+	char buf[1024];
+	snprintf(buf, sizeof(buf),
+		"# Compaction\r\n"
+		"rate_limit:%lld\r\n"
+		"rate_limit_auto:%d\r\n"
+		"rate_limit_current:%lld\r\n"
+		"rate_limit_bytes_through:%lld\r\n"
+		"compaction_pending_shards:%d\r\n"
+		"compaction_pending_bytes:%llu\r\n"
+		"compact_in_progress:%d\r\n"
+		"compact_steps_done:%d\r\n"
+		"compact_steps_total:%d\r\n"
+		"compact_current_time_ms:%lld\r\n"
+		"last_compact_status:%s\r\n"
+		"last_compact_duration_ms:%llu\r\n"
+		"compactions:%llu\r\n",
+		(long long)rate_limit, rate_limit_auto ? 1 : 0,
+		(long long)(limiter ? rate_current : 0),
+		(long long)(limiter ? limiter->GetTotalBytesThrough() : 0),
+		running, (unsigned long long)pending,
+		compact_current ? 1 : 0,
+		compact_current ? compact_current->done.load() : 0,
+		compact_current ? compact_current->total : 0,
+		compact_current ? (long long)(uv_now(loop)-compact_current->started) : -1LL,
+		lastcompact_status, (unsigned long long)lastcompact_duration_ms,
+		(unsigned long long)compactions);
+	out->append(buf);
+}
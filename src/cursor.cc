@@ -0,0 +1,152 @@
+#include "server.h"
+#include <map>
+
+// SCAN cursor sessions. The first page of a SCAN takes a snapshot of every
+// shard and keeps the iterator in a session, the cursor that it returns has
+// CURSOR_SESSION set, the session id above the lower 32 bits and the position
+// in them. A position that doesn't fit in 32 bits is returned as it is,
+// without a session, so it's never taken for a session id.
+// The following pages go on from where the iterator stopped, so a whole SCAN
+// sees one point in time and each page only pays for its own keys.
+//
+// Sessions pin the snapshot and the files under it, so there are at most
+// --scan-cursors of them, the least recently used is closed to make room,
+// and a session that isn't used for --scan-cursor-ttl seconds is closed. A
+// cursor whose session is gone is still valid, the position is found again
+// by counting matches from the start, like without sessions.
+int scan_cursors = 64;
+int scan_cursor_ttl = 60;
+
+const int64_t CURSOR_SESSION = (int64_t)1<<62;
+
+static std::map<uint32_t, scan_cursor*> cursors;
+static uint32_t next_id = 0;
+static uint64_t cursors_opened = 0;
+static uint64_t cursors_expired = 0;
+static uint64_t cursors_evicted = 0;
+static uv_timer_t cursor_timer;
+
+void cursor_close(scan_cursor *sc){
+	cursors.erase(sc->id);
+	delete sc->it;
+	db_release(&sc->snaps);
+	delete sc;
+}
+
+// cursor_reset closes all sessions, before the database is closed.
+void cursor_reset(){
+	while (cursors.size()){
+		cursor_close(cursors.begin()->second);
+	}
+}
+
+static scan_cursor *cursor_new(){
+	if ((int)cursors.size() >= scan_cursors){
+		scan_cursor *lru = NULL;
+		for (auto it=cursors.begin();it!=cursors.end();it++){
+			if (!lru || it->second->used < lru->used){
+				lru = it->second;
+			}
+		}
+		cursor_close(lru);
+		cursors_evicted++;
+	}
+	do {
+		next_id = (next_id+1)&0x3FFFFFFF;
+	} while (!next_id || cursors.count(next_id));
+	scan_cursor *sc = new scan_cursor();
+	sc->id = next_id;
+	sc->pos = 0;
+	sc->fresh = true;
+	db_snapshot(&sc->snaps);
+	rocksdb::ReadOptions options;
+	sc->it = db_snapshot_iterator(NULL, options, sc->snaps);
+	cursors[sc->id] = sc;
+	cursors_opened++;
+	return sc;
+}
+
+// cursor_position returns the number of matches that a SCAN cursor is past.
+int64_t cursor_position(int64_t cursor){
+	if (cursor & CURSOR_SESSION){
+		return cursor&0xFFFFFFFF;
+	}
+	return cursor;
+}
+
+// cursor_get returns the session for a SCAN cursor, or a new one that has
+// to count its way to the position. NULL when sessions are off.
+scan_cursor *cursor_get(int64_t cursor, const char *pat, int pat_len){
+	if (scan_cursors <= 0 || db_in_transaction()){
+		return NULL;
+	}
+	auto it = cursor & CURSOR_SESSION ?
+		cursors.find((cursor>>32)&0x3FFFFFFF) : cursors.end();
+	if (it != cursors.end()){
+		scan_cursor *sc = it->second;
+		if (sc->pos == cursor_position(cursor) &&
+			sc->pat.compare(0, std::string::npos, pat, pat_len) == 0){
+			sc->used = uv_now(loop);
+			return sc;
+		}
+	}
+	scan_cursor *sc = cursor_new();
+	sc->pat.assign(pat, pat_len);
+	sc->used = uv_now(loop);
+	return sc;
+}
+
+// cursor_next records where the page stopped and returns the cursor for the
+// next page, or 0 when the iteration is done and the session is closed.
+int64_t cursor_next(scan_cursor *sc, int64_t pos){
+	if (pos == 0 || pos > 0xFFFFFFFF){
+		cursor_close(sc);
+		return pos;
+	}
+	sc->pos = pos;
+	sc->fresh = false;
+	return CURSOR_SESSION|((int64_t)sc->id<<32)|pos;
+}
+
+static void on_cursor_timer(uv_timer_t *){
+	uint64_t now = uv_now(loop);
+	std::vector<scan_cursor*> expired;
+	for (auto it=cursors.begin();it!=cursors.end();it++){
+		if (now-it->second->used >= (uint64_t)scan_cursor_ttl*1000){
+			expired.push_back(it->second);
+		}
+	}
+	for (size_t i=0;i<expired.size();i++){
+		cursor_close(expired[i]);
+		cursors_expired++;
+	}
+}
+
+void cursor_init(){
+	uv_timer_init(loop, &cursor_timer);
+	uv_timer_start(&cursor_timer, on_cursor_timer, 1000, 1000);
+}
+
+void cursor_info(std::string *out){
+	uint64_t now = uv_now(loop), oldest = 0;
+	for (auto it=cursors.begin();it!=cursors.end();it++){
+		if (now-it->second->used > oldest){
+			oldest = now-it->second->used;
+		}
+	}
+	char buf[512];
+	snprintf(buf, sizeof(buf),
+		"# Cursors\r\n"
+		"scan_cursors:%zu\r\n"
+		"scan_cursors_max:%d\r\n"
+		"scan_cursor_ttl:%d\r\n"
+		"scan_cursor_idle_ms:%llu\r\n"
+		"scan_cursors_opened:%llu\r\n"
+		"scan_cursors_expired:%llu\r\n"
+		"scan_cursors_evicted:%llu\r\n",
+		cursors.size(), scan_cursors, scan_cursor_ttl,
+		(unsigned long long)oldest, (unsigned long long)cursors_opened,
+		(unsigned long long)cursors_expired,
+		(unsigned long long)cursors_evicted);
+	out->append(buf);
+}
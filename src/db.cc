@@ -0,0 +1,404 @@
+#include "server.h"
+#include <set>
+
+// The db_* functions are how commands read and write the database. Keys are
+// partitioned across the shards by hash, the fields of a hash go to the shard
+// of the hash key. Outside of a transaction they go straight to RocksDB.
+// While EXEC is running, writes are collected in a batch per shard and reads
+// come from a snapshot per shard, overlaid with the writes already queued in
+// the batch.
+static std::vector<rocksdb::WriteBatchWithIndex*> txbatch;
+static std::vector<const rocksdb::Snapshot*> txsnap;
+// sequences of the open snapshots of each shard, see db_oldest_snapshot.
+static std::vector<std::multiset<uint64_t> > snapseqs;
+
+static void check_status(const rocksdb::Status &s){
+	if (!s.ok()){
+		err(1, "%s", s.ToString().c_str());
+	}
+}
+
+static rocksdb::WriteOptions write_options(){
+	rocksdb::WriteOptions write_options;
+	write_options.sync = !nosync;
+	return write_options;
+}
+
+static rocksdb::ReadOptions read_options(int i){
+	rocksdb::ReadOptions read_options;
+	read_options.snapshot = txsnap.size() ? txsnap[i] : NULL;
+	return read_options;
+}
+
+static int shard_of(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key){
+	if (nshards == 1){
+		return 0;
+	}
+	rocksdb::Slice k = key;
+	if (cf == hashcf){
+		k = hash_key_of(key);
+	}
+	return shard_of_key(k.data(), k.size(), nshards);
+}
+
+static rocksdb::ColumnFamilyHandle *shard_cf(int i, rocksdb::ColumnFamilyHandle *cf){
+	return cf == hashcf ? shards[i].hashcf : shards[i].db->DefaultColumnFamily();
+}
+
+bool db_get(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key,
+		std::string *value
+){
+	int i = shard_of(cf, key);
+	rocksdb::DB *db = shards[i].db;
+	rocksdb::Status s;
+	warmup_touch(cf, key);
+	if (txbatch.size()){
+		s = txbatch[i]->GetFromBatchAndDB(db, read_options(i), shard_cf(i, cf),
+			key, value);
+	}else{
+		s = db->Get(read_options(i), shard_cf(i, cf), key, value);
+	}
+	if (s.IsNotFound()){
+		return false;
+	}
+	check_status(s);
+	return true;
+}
+
+// db_put writes a value. Large string values go to the value log and the key
+// gets a pointer to them.
+void db_put(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key,
+		const rocksdb::Slice &value
+){
+	int i = shard_of(cf, key);
+	std::string ptr;
+	rocksdb::Slice v = value;
+	if (!cf && vlog_separate(i, key, value, &ptr)){
+		v = ptr;
+	}
+	if (txbatch.size()){
+		txbatch[i]->Put(shard_cf(i, cf), key, v);
+	}else{
+		check_status(shards[i].db->Put(write_options(), shard_cf(i, cf), key, v));
+	}
+	touch_key(cf, key);
+}
+
+void db_delete(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key){
+	int i = shard_of(cf, key);
+	if (txbatch.size()){
+		txbatch[i]->Delete(shard_cf(i, cf), key);
+	}else{
+		check_status(shards[i].db->Delete(write_options(), shard_cf(i, cf), key));
+	}
+	touch_key(cf, key);
+}
+
+void db_merge(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key,
+		const rocksdb::Slice &value
+){
+	int i = shard_of(cf, key);
+	if (txbatch.size()){
+		txbatch[i]->Merge(shard_cf(i, cf), key, value);
+	}else{
+		check_status(shards[i].db->Merge(write_options(), shard_cf(i, cf), key, value));
+	}
+	touch_key(cf, key);
+}
+
+// db_multi_get reads string keys with one MultiGet per shard.
+void db_multi_get(const std::vector<rocksdb::Slice> &keys,
+		std::vector<std::string> *values, std::vector<bool> *found
+){
+	values->assign(keys.size(), std::string());
+	found->assign(keys.size(), false);
+	if (txbatch.size()){
+		for (size_t j=0;j<keys.size();j++){
+			(*found)[j] = db_get(NULL, keys[j], &(*values)[j]);
+		}
+		return;
+	}
+	std::vector<std::vector<size_t> > idx(nshards);
+	for (size_t j=0;j<keys.size();j++){
+		idx[shard_of(NULL, keys[j])].push_back(j);
+		warmup_touch(NULL, keys[j]);
+	}
+	for (int i=0;i<nshards;i++){
+		if (idx[i].empty()){
+			continue;
+		}
+		std::vector<rocksdb::Slice> skeys;
+		for (size_t j=0;j<idx[i].size();j++){
+			skeys.push_back(keys[idx[i][j]]);
+		}
+		std::vector<std::string> svalues;
+		std::vector<rocksdb::Status> ss = shards[i].db->MultiGet(
+			read_options(i), skeys, &svalues);
+		for (size_t j=0;j<idx[i].size();j++){
+			if (ss[j].IsNotFound()){
+				continue;
+			}
+			check_status(ss[j]);
+			(*values)[idx[i][j]].swap(svalues[j]);
+			(*found)[idx[i][j]] = true;
+		}
+	}
+}
+
+// db_prefetch reads key, outside of any transaction, to bring its blocks
+// into the caches. It may be used from any thread.
+void db_prefetch(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key){
+	int i = shard_of(cf, key);
+	std::string value;
+	shards[i].db->Get(rocksdb::ReadOptions(), shard_cf(i, cf), key, &value);
+}
+
+// batch_handler splits a batch by shard, into the transaction batches or
+// into a batch per shard, and marks the keys that it writes as touched.
+class batch_handler : public rocksdb::WriteBatch::Handler {
+	rocksdb::ColumnFamilyHandle *cf(uint32_t id){
+		return id == hashcf->GetID() ? hashcf : NULL;
+	}
+	rocksdb::WriteBatchBase *dst(rocksdb::ColumnFamilyHandle *cf,
+			const rocksdb::Slice &key, rocksdb::ColumnFamilyHandle **scf){
+		int i = shard_of(cf, key);
+		*scf = shard_cf(i, cf);
+		if (txbatch.size()){
+			return txbatch[i];
+		}
+		return split.size() ? &split[i] : NULL;
+	}
+public:
+	std::vector<rocksdb::WriteBatch> split;
+	virtual rocksdb::Status PutCF(uint32_t id, const rocksdb::Slice &key,
+			const rocksdb::Slice &value) override {
+		rocksdb::ColumnFamilyHandle *scf;
+		rocksdb::WriteBatchBase *b = dst(cf(id), key, &scf);
+		if (b){
+			std::string ptr;
+			if (!cf(id) && vlog_separate(shard_of(NULL, key), key, value, &ptr)){
+				b->Put(scf, key, ptr);
+			}else{
+				b->Put(scf, key, value);
+			}
+		}
+		touch_key(cf(id), key);
+		return rocksdb::Status::OK();
+	}
+	virtual rocksdb::Status DeleteCF(uint32_t id,
+			const rocksdb::Slice &key) override {
+		rocksdb::ColumnFamilyHandle *scf;
+		rocksdb::WriteBatchBase *b = dst(cf(id), key, &scf);
+		if (b){
+			b->Delete(scf, key);
+		}
+		touch_key(cf(id), key);
+		return rocksdb::Status::OK();
+	}
+	virtual rocksdb::Status MergeCF(uint32_t id, const rocksdb::Slice &key,
+			const rocksdb::Slice &value) override {
+		rocksdb::ColumnFamilyHandle *scf;
+		rocksdb::WriteBatchBase *b = dst(cf(id), key, &scf);
+		if (b){
+			b->Merge(scf, key, value);
+		}
+		touch_key(cf(id), key);
+		return rocksdb::Status::OK();
+	}
+};
+
+// db_write applies a batch. With more than one shard the batch is only
+// atomic within each shard.
+void db_write(rocksdb::WriteBatch *batch){
+	bool direct = !txbatch.size() && nshards == 1 && vlog_threshold <= 0;
+	if (direct){
+		check_status(shards[0].db->Write(write_options(), batch));
+		if (!watching()){
+			return;
+		}
+	}
+	batch_handler handler;
+	if (!direct && !txbatch.size()){
+		handler.split.resize(nshards);
+	}
+	check_status(batch->Iterate(&handler));
+	for (size_t i=0;i<handler.split.size();i++){
+		if (handler.split[i].Count() > 0){
+			check_status(shards[i].db->Write(write_options(), &handler.split[i]));
+		}
+	}
+}
+
+// db_write_shard applies a batch from the primary to shard i as is, so the
+// shard ends up with the same sequence numbers as on the primary.
+void db_write_shard(int i, rocksdb::WriteBatch *batch){
+	check_status(shards[i].db->Write(write_options(), batch));
+	if (watching()){
+		batch_handler handler;
+		check_status(batch->Iterate(&handler));
+	}
+}
+
+// merge_iterator iterates over the keys of all shards in order. The shards
+// never share a key. It only moves forward.
+class merge_iterator : public rocksdb::Iterator {
+	std::vector<rocksdb::Iterator*> its;
+	rocksdb::Iterator *cur;
+	void pick(){
+		cur = NULL;
+		for (size_t i=0;i<its.size();i++){
+			if (its[i]->Valid() && (!cur || its[i]->key().compare(cur->key()) < 0)){
+				cur = its[i];
+			}
+		}
+	}
+public:
+	merge_iterator(const std::vector<rocksdb::Iterator*> &its) : its(its), cur(NULL) {}
+	virtual ~merge_iterator(){
+		for (size_t i=0;i<its.size();i++){
+			delete its[i];
+		}
+	}
+	virtual bool Valid() const override {
+		return cur != NULL;
+	}
+	virtual void SeekToFirst() override {
+		for (size_t i=0;i<its.size();i++){
+			its[i]->SeekToFirst();
+		}
+		pick();
+	}
+	virtual void SeekToLast() override {
+		cur = NULL;
+	}
+	virtual void Seek(const rocksdb::Slice &target) override {
+		for (size_t i=0;i<its.size();i++){
+			its[i]->Seek(target);
+		}
+		pick();
+	}
+	virtual void Next() override {
+		cur->Next();
+		pick();
+	}
+	virtual void Prev() override {
+		cur = NULL;
+	}
+	virtual rocksdb::Slice key() const override {
+		return cur->key();
+	}
+	virtual rocksdb::Slice value() const override {
+		return cur->value();
+	}
+	virtual rocksdb::Status status() const override {
+		for (size_t i=0;i<its.size();i++){
+			if (!its[i]->status().ok()){
+				return its[i]->status();
+			}
+		}
+		return rocksdb::Status::OK();
+	}
+};
+
+// db_snapshot_iterator returns a new iterator over all shards that reads
+// from snaps, a snapshot per shard, or the latest state when it's empty. It
+// may be used from any thread.
+rocksdb::Iterator *db_snapshot_iterator(rocksdb::ColumnFamilyHandle *cf,
+		rocksdb::ReadOptions &options,
+		const std::vector<const rocksdb::Snapshot*> &snaps
+){
+	std::vector<rocksdb::Iterator*> its;
+	for (int i=0;i<nshards;i++){
+		options.snapshot = snaps.size() ? snaps[i] : NULL;
+		its.push_back(shards[i].db->NewIterator(options, shard_cf(i, cf)));
+	}
+	if (nshards == 1){
+		return its[0];
+	}
+	return new merge_iterator(its);
+}
+
+// db_iterator returns a new iterator over all shards. Inside of a
+// transaction it reads from the transaction snapshot only, writes queued
+// earlier in the same transaction are not visible to it.
+rocksdb::Iterator *db_iterator(rocksdb::ColumnFamilyHandle *cf,
+		rocksdb::ReadOptions &options
+){
+	return db_snapshot_iterator(cf, options, txsnap);
+}
+
+// db_key_iterator returns a new iterator over the shard that key belongs to,
+// for readers that stay within the prefix of one key, like the fields of a
+// hash. It reads from the transaction snapshot like db_iterator.
+rocksdb::Iterator *db_key_iterator(rocksdb::ColumnFamilyHandle *cf,
+		const rocksdb::Slice &key, rocksdb::ReadOptions &options
+){
+	int i = shard_of(cf, key);
+	options.snapshot = txsnap.size() ? txsnap[i] : NULL;
+	return shards[i].db->NewIterator(options, shard_cf(i, cf));
+}
+
+static const rocksdb::Snapshot *take_snapshot(int i){
+	const rocksdb::Snapshot *snap = shards[i].db->GetSnapshot();
+	if ((int)snapseqs.size() < nshards){
+		snapseqs.resize(nshards);
+	}
+	snapseqs[i].insert(snap->GetSequenceNumber());
+	return snap;
+}
+
+static void release_snapshot(int i, const rocksdb::Snapshot *snap){
+	snapseqs[i].erase(snapseqs[i].find(snap->GetSequenceNumber()));
+	shards[i].db->ReleaseSnapshot(snap);
+}
+
+// db_snapshot takes a snapshot of every shard, for readers that run after
+// the command returns. They're released with db_release.
+void db_snapshot(std::vector<const rocksdb::Snapshot*> *snaps){
+	for (int i=0;i<nshards;i++){
+		snaps->push_back(take_snapshot(i));
+	}
+}
+
+void db_release(std::vector<const rocksdb::Snapshot*> *snaps){
+	for (size_t i=0;i<snaps->size();i++){
+		release_snapshot(i, (*snaps)[i]);
+	}
+	snaps->clear();
+}
+
+// db_oldest_snapshot returns the sequence of the oldest open snapshot of
+// shard i, or UINT64_MAX when there's none.
+uint64_t db_oldest_snapshot(int i){
+	if (i >= (int)snapseqs.size() || snapseqs[i].empty()){
+		return UINT64_MAX;
+	}
+	return *snapseqs[i].begin();
+}
+
+// db_in_transaction returns true while EXEC is running.
+bool db_in_transaction(){
+	return txbatch.size() > 0;
+}
+
+// db_begin starts a transaction. All db_* calls up until db_commit are
+// applied as a single atomic write per shard.
+void db_begin(){
+	for (int i=0;i<nshards;i++){
+		txsnap.push_back(take_snapshot(i));
+		txbatch.push_back(new rocksdb::WriteBatchWithIndex());
+	}
+}
+
+void db_commit(){
+	for (int i=0;i<nshards;i++){
+		if (txbatch[i]->GetWriteBatch()->Count() > 0){
+			check_status(shards[i].db->Write(write_options(),
+				txbatch[i]->GetWriteBatch()));
+		}
+		delete txbatch[i];
+		release_snapshot(i, txsnap[i]);
+	}
+	txbatch.clear();
+	txsnap.clear();
+}
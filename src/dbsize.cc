@@ -0,0 +1,141 @@
+#include "server.h"
+
+// DBSIZE returns RocksDB's estimate of the number of string keys, which comes
+// from the table properties and the memtables and costs nothing to read. It
+// counts overwritten, deleted and expired keys that haven't been compacted
+// away yet. DBSIZE EXACT counts them with an iteration on the thread pool,
+// skipping expired keys. The count is kept for DBSIZE_CACHE_MS, clients that
+// ask while it's running wait for the same count.
+const uint64_t DBSIZE_CACHE_MS = 10*1000;
+
+typedef struct count_job_t {
+	uv_work_t req;
+	uint64_t count;
+	uint64_t start;
+	std::vector<client*> waiting;
+} count_job;
+
+static count_job *count_current = NULL;
+static bool exact_valid = false;
+static uint64_t exact_count = 0;
+static uint64_t exact_time = 0;
+static uint64_t exact_duration_ms = 0;
+
+bool dbsize_in_progress(){
+	return count_current != NULL;
+}
+
+// dbsize_reset forgets the exact count, the database was replaced.
+void dbsize_reset(){
+	exact_valid = false;
+}
+
+static uint64_t estimate_keys(){
+	uint64_t total = 0;
+	for (int i=0;i<nshards;i++){
+		uint64_t n;
+		if (shards[i].db->GetIntProperty("rocksdb.estimate-num-keys", &n)){
+			total += n;
+		}
+	}
+	return total;
+}
+
+static void on_count_work(uv_work_t *req){
+	count_job *job = (count_job*)req->data;
+	int64_t now = now_ms();
+	rocksdb::ReadOptions options;
+	options.fill_cache = false;
+	for (int i=0;i<nshards;i++){
+		rocksdb::Iterator *it = shards[i].db->NewIterator(options);
+		for (it->SeekToFirst();it->Valid();it->Next()){
+			record r;
+			rocksdb::Slice value = it->value();
+			record_decode(value.data(), value.size(), &r);
+			if (!record_expired(&r, now)){
+				job->count++;
+			}
+		}
+		delete it;
+	}
+}
+
+static void on_count_work_done(uv_work_t *req, int){
+	count_job *job = (count_job*)req->data;
+	count_current = NULL;
+	exact_valid = true;
+	exact_count = job->count;
+	exact_time = uv_now(loop);
+	exact_duration_ms = exact_time-job->start;
+	for (size_t i=0;i<job->waiting.size();i++){
+		client_write_int(job->waiting[i], job->count);
+		client_unblock(job->waiting[i]);
+	}
+	delete job;
+}
+
+error exec_dbsize(client *c){
+	if (c->args_len>2){
+		return "wrong number of arguments for 'dbsize' command";
+	}
+	if (c->args_len==1){
+		client_write_int(c, estimate_keys());
+		return NULL;
+	}
+	if (!islstr(c, 1, "exact")){
+		return "syntax error";
+	}
+	if (exact_valid && uv_now(loop)-exact_time < DBSIZE_CACHE_MS){
+		client_write_int(c, exact_count);
+		return NULL;
+	}
+	if (!count_current){
+		count_current = new count_job();
+		count_current->req.data = count_current;
+		count_current->count = 0;
+		count_current->start = uv_now(loop);
+		uv_queue_work(loop, &count_current->req, on_count_work,
+			on_count_work_done);
+	}
+	count_current->waiting.push_back(c);
+	client_block(c);
+	return NULL;
+}
+
+// RANGESIZE returns the approximate number of bytes used by the string keys
+// from start up to end, including the memtables. The files are compressed, so
+// it's usually less than the size of the data.
+error exec_rangesize(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'rangesize' command";
+	}
+	rocksdb::Range range(rocksdb::Slice(c->args[1], c->args_size[1]),
+		rocksdb::Slice(c->args[2], c->args_size[2]));
+	uint64_t total = 0;
+	if (range.start.compare(range.limit) < 0){
+		for (int i=0;i<nshards;i++){
+			uint64_t size = 0;
+			shards[i].db->GetApproximateSizes(&range, 1, &size, true);
+			total += size;
+		}
+	}
+	client_write_int(c, total);
+	return NULL;
+}
+
+void dbsize_info(std::string *out){
+	char buf[512];
+	snprintf(buf, sizeof(buf),
+		"# Keyspace\r\n"
+		"keys_estimate:%llu\r\n"
+		"keys_exact:%lld\r\n"
+		"keys_exact_age_ms:%lld\r\n"
+		"keys_exact_duration_ms:%llu\r\n"
+		"keys_count_in_progress:%d\r\n",
+		(unsigned long long)estimate_keys(),
+		exact_valid ? (long long)exact_count : -1LL,
+		exact_valid ? (long long)(uv_now(loop)-exact_time) : -1LL,
+		(unsigned long long)exact_duration_ms,
+		count_current ? 1 : 0);
+	out->append(buf);
+}
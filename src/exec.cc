@@ -1,6 +1,6 @@
 #include "server.h"
 
-static bool islstr(client *c, int arg_idx, const char *str){
+bool islstr(client *c, int arg_idx, const char *str){
 	int i = 0;
 	for (;i<c->args_size[arg_idx];i++){
 		if (c->args[arg_idx][i] != str[i] && c->args[arg_idx][i] != str[i]-32){
@@ -14,6 +14,37 @@ static bool iscmd(client *c, const char *cmd){
 	return islstr(c, 0, cmd);
 }
 
+// get_record reads and decodes the record stored at key. returns false when
+// the key does not exist or has expired. expired records are removed lazily
+// by the compaction filter.
+static bool get_record(const rocksdb::Slice &key, std::string *raw, record *r){
+	if (!db_get(NULL, key, raw)){
+		return false;
+	}
+	record_decode(raw->data(), raw->size(), r);
+	return !record_expired(r, now_ms());
+}
+
+static void put_record(const rocksdb::Slice &key, 
+		const char *data, int len, int64_t expires
+){
+	std::string value;
+	record_encode(&value, data, len, expires);
+	db_put(NULL, key, value);
+}
+
+// reput_record stores r again with a new expiration. A value in the value log
+// isn't copied.
+static void reput_record(const rocksdb::Slice &key, const record *r,
+		int64_t expires
+){
+	std::string value;
+	record_reencode(&value, r, expires);
+	db_put(NULL, key, value);
+}
+
+static const char *ERR_VLOG = "value missing from the value log";
+
 error exec_set(client *c){
 	const char **argv = c->args;
 	int *argl = c->args_size;
@@ -21,18 +52,41 @@ error exec_set(client *c){
 	if (argc!=3){
 		return "wrong number of arguments for 'set' command";
 	}	
-	std::string key(argv[1], argl[1]);
-	std::string value(argv[2], argl[2]);
-	rocksdb::WriteOptions write_options;
-	write_options.sync = !nosync;
-	rocksdb::Status s = db->Put(write_options, key, value);
-	if (!s.ok()){
-		err(1, "%s", s.ToString().c_str());
+	put_record(rocksdb::Slice(argv[1], argl[1]), argv[2], argl[2], 0);
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+static error exec_setex_generic(client *c, int64_t unit){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int64_t ttl;
+	if (!atoi64(argv[2], argl[2], &ttl)){
+		return "value is not an integer or out of range";
+	}
+	if (ttl <= 0 || ttl > INT64_MAX/unit/2){
+		return "invalid expire time";
 	}
+	put_record(rocksdb::Slice(argv[1], argl[1]), argv[3], argl[3], 
+		now_ms()+ttl*unit);
 	client_write(c, "+OK\r\n", 5);
 	return NULL;
 }
 
+error exec_setex(client *c){
+	if (c->args_len!=4){
+		return "wrong number of arguments for 'setex' command";
+	}
+	return exec_setex_generic(c, 1000);
+}
+
+error exec_psetex(client *c){
+	if (c->args_len!=4){
+		return "wrong number of arguments for 'psetex' command";
+	}
+	return exec_setex_generic(c, 1);
+}
+
 error exec_get(client *c){
 	const char **argv = c->args;
 	int *argl = c->args_size;
@@ -40,17 +94,160 @@ error exec_get(client *c){
 	if (argc!=2){
 		return "wrong number of arguments for 'get' command";
 	}	
-	std::string key(argv[1], argl[1]);
-	std::string value;
-	rocksdb::Status s = db->Get(rocksdb::ReadOptions(), key, &value);
-	if (!s.ok()){
-		if (s.IsNotFound()){
+	std::string value, buf;
+	record r;
+	if (!get_record(rocksdb::Slice(argv[1], argl[1]), &value, &r)){
+		client_write(c, "$-1\r\n", 5);
+		return NULL;
+	}
+	if (r.hash){
+		return ERR_WRONGTYPE;
+	}
+	if (!vlog_resolve(&r, &buf)){
+		return ERR_VLOG;
+	}
+	client_write_bulk(c, r.data, r.len);
+	return NULL;
+}
+
+// MGET reads all keys with one MultiGet per shard.
+error exec_mget(client *c){
+	if (c->args_len<2){
+		return "wrong number of arguments for 'mget' command";
+	}
+	std::vector<rocksdb::Slice> keys;
+	for (int i=1;i<c->args_len;i++){
+		keys.push_back(rocksdb::Slice(c->args[i], c->args_size[i]));
+	}
+	std::vector<std::string> values;
+	std::vector<bool> found;
+	db_multi_get(keys, &values, &found);
+	int64_t now = now_ms();
+	client_write_multibulk(c, keys.size());
+	for (size_t i=0;i<keys.size();i++){
+		record r;
+		if (found[i]){
+			record_decode(values[i].data(), values[i].size(), &r);
+		}
+		std::string buf;
+		if (!found[i] || record_expired(&r, now) || r.hash ||
+			!vlog_resolve(&r, &buf)){
 			client_write(c, "$-1\r\n", 5);
-			return NULL;
+		}else{
+			client_write_bulk(c, r.data, r.len);
 		}
-		err(1, "%s", s.ToString().c_str());
 	}
-	client_write_bulk(c, value.data(), value.size());
+	return NULL;
+}
+
+// MSET writes all keys as one batch, which is atomic per shard.
+error exec_mset(client *c){
+	if (c->args_len<3 || c->args_len%2 != 1){
+		return "wrong number of arguments for 'mset' command";
+	}
+	rocksdb::WriteBatch batch;
+	for (int i=1;i<c->args_len;i+=2){
+		std::string value;
+		record_encode(&value, c->args[i+1], c->args_size[i+1], 0);
+		batch.Put(rocksdb::Slice(c->args[i], c->args_size[i]), value);
+	}
+	db_write(&batch);
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+static error exec_expire_generic(client *c, int64_t unit){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int64_t ttl;
+	if (!atoi64(argv[2], argl[2], &ttl)){
+		return "value is not an integer or out of range";
+	}
+	if (ttl > INT64_MAX/unit/2 || ttl < INT64_MIN/unit/2){
+		return "invalid expire time";
+	}
+	rocksdb::Slice key(argv[1], argl[1]);
+	std::string value;
+	record r;
+	if (!get_record(key, &value, &r)){
+		client_write(c, ":0\r\n", 4);
+		return NULL;
+	}
+	if (ttl <= 0){
+		db_delete(NULL, key);
+		if (r.hash){
+			hash_delete(argv[1], argl[1]);
+		}
+	}else{
+		reput_record(key, &r, now_ms()+ttl*unit);
+	}
+	client_write(c, ":1\r\n", 4);
+	return NULL;
+}
+
+error exec_expire(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'expire' command";
+	}
+	return exec_expire_generic(c, 1000);
+}
+
+error exec_pexpire(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'pexpire' command";
+	}
+	return exec_expire_generic(c, 1);
+}
+
+static error exec_ttl_generic(client *c, int64_t unit){
+	std::string value;
+	record r;
+	if (!get_record(rocksdb::Slice(c->args[1], c->args_size[1]), &value, &r)){
+		client_write(c, ":-2\r\n", 5);
+		return NULL;
+	}
+	if (!r.expires){
+		client_write(c, ":-1\r\n", 5);
+		return NULL;
+	}
+	int64_t ttl = r.expires-now_ms();
+	if (ttl < 0){
+		ttl = 0;
+	}
+	client_write_int(c, (ttl+unit/2)/unit);
+	return NULL;
+}
+
+error exec_ttl(client *c){
+	if (c->args_len!=2){
+		return "wrong number of arguments for 'ttl' command";
+	}
+	return exec_ttl_generic(c, 1000);
+}
+
+error exec_pttl(client *c){
+	if (c->args_len!=2){
+		return "wrong number of arguments for 'pttl' command";
+	}
+	return exec_ttl_generic(c, 1);
+}
+
+error exec_persist(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc!=2){
+		return "wrong number of arguments for 'persist' command";
+	}
+	rocksdb::Slice key(argv[1], argl[1]);
+	std::string value;
+	record r;
+	if (!get_record(key, &value, &r) || !r.expires){
+		client_write(c, ":0\r\n", 4);
+		return NULL;
+	}
+	reput_record(key, &r, 0);
+	client_write(c, ":1\r\n", 4);
 	return NULL;
 }
 
@@ -61,23 +258,215 @@ error exec_del(client *c){
 	if (argc!=2){
 		return "wrong number of arguments for 'del' command";
 	}
-	std::string key(argv[1], argl[1]);
+	rocksdb::Slice key(argv[1], argl[1]);
 	std::string value; 
-	rocksdb::Status s = db->Get(rocksdb::ReadOptions(), key, &value);
-	if (!s.ok()){
-		if (s.IsNotFound()){
-			client_write(c, ":0\r\n", 4);
-			return NULL;
+	bool live = false;
+	if (db_get(NULL, key, &value)){
+		record r;
+		record_decode(value.data(), value.size(), &r);
+		live = !record_expired(&r, now_ms());
+		db_delete(NULL, key);
+	}
+	// also the fields that an expired or overwritten hash left behind.
+	hash_delete(argv[1], argl[1]);
+	if (live){
+		client_write(c, ":1\r\n", 4);
+	}else{
+		client_write(c, ":0\r\n", 4);
+	}
+	return NULL;
+}
+
+// merge adds a merge operand for key without reading it. A value in the
+// value log is read, changed and written back instead.
+static void merge(const rocksdb::Slice &key, char tag,
+		const char *data, int data_len
+){
+	std::string operand;
+	operand.reserve(data_len+1);
+	operand.push_back(tag);
+	operand.append(data, data_len);
+	if (vlog_in_use()){
+		std::string raw, buf, result;
+		record r;
+		if (db_get(NULL, key, &raw)){
+			record_decode(raw.data(), raw.size(), &r);
+			if (r.vlog && vlog_resolve(&r, &buf)){
+				int64_t expires = r.expires;
+				if (!record_expired(&r, now_ms())){
+					result.assign(r.data, r.len);
+				}else{
+					expires = 0;
+				}
+				merge_apply(&result, operand);
+				put_record(key, result.data(), result.size(), expires);
+				return;
+			}
 		}
-		err(1, "%s", s.ToString().c_str());
 	}
-	rocksdb::WriteOptions write_options;
-	write_options.sync = !nosync;
-	s = db->Delete(write_options, key);
-	if (!s.ok()){
-		err(1, "%s", s.ToString().c_str());
+	db_merge(NULL, key, operand);
+}
+
+// incr_value reads the integer stored at key, 0 when there's none.
+static error incr_value(const rocksdb::Slice &key, int64_t *n){
+	std::string raw, buf;
+	record r;
+	*n = 0;
+	if (!get_record(key, &raw, &r)){
+		return NULL;
 	}
-	client_write(c, ":1\r\n", 4);
+	if (r.hash){
+		return ERR_WRONGTYPE;
+	}
+	if (!vlog_resolve(&r, &buf)){
+		return ERR_VLOG;
+	}
+	if (!atoi64(r.data, r.len, n)){
+		return "value is not an integer or out of range";
+	}
+	return NULL;
+}
+
+// INCR and friends add the merge operand without reading first and reply
+// with the value read back through a merged Get, which is cheap because the
+// operand is still in the memtable. An increment of a value that isn't an
+// integer, or one that would overflow, is dropped by the merge. With
+// --checked-merge the value is read first instead, so that such an
+// increment is refused before anything is written.
+static error exec_incrby_generic(client *c, int64_t delta){
+	rocksdb::Slice key(c->args[1], c->args_size[1]);
+	char nb[32];
+	sprintf(nb, "%lld", (long long)delta);
+	int64_t n;
+	error e;
+	if (!checked_merge){
+		merge(key, MERGE_INCR, nb, strlen(nb));
+		e = incr_value(key, &n);
+		if (e){
+			return e;
+		}
+		client_write_int(c, n);
+		return NULL;
+	}
+	e = incr_value(key, &n);
+	if (e){
+		return e;
+	}
+	if ((delta > 0 && n > INT64_MAX-delta) ||
+		(delta < 0 && n < INT64_MIN-delta)){
+		return "increment or decrement would overflow";
+	}
+	merge(key, MERGE_INCR, nb, strlen(nb));
+	client_write_int(c, n+delta);
+	return NULL;
+}
+
+error exec_incr(client *c){
+	if (c->args_len!=2){
+		return "wrong number of arguments for 'incr' command";
+	}
+	return exec_incrby_generic(c, 1);
+}
+
+error exec_decr(client *c){
+	if (c->args_len!=2){
+		return "wrong number of arguments for 'decr' command";
+	}
+	return exec_incrby_generic(c, -1);
+}
+
+error exec_incrby(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'incrby' command";
+	}
+	int64_t delta;
+	if (!atoi64(c->args[2], c->args_size[2], &delta)){
+		return "value is not an integer or out of range";
+	}
+	return exec_incrby_generic(c, delta);
+}
+
+error exec_decrby(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'decrby' command";
+	}
+	int64_t delta;
+	if (!atoi64(c->args[2], c->args_size[2], &delta) || delta == INT64_MIN){
+		return "value is not an integer or out of range";
+	}
+	return exec_incrby_generic(c, -delta);
+}
+
+// string_len returns the length of the string at key, 0 when there's none.
+// A value in the value log isn't read, its pointer has the length.
+static error string_len(const rocksdb::Slice &key, int64_t *len){
+	std::string raw;
+	record r;
+	*len = 0;
+	if (!get_record(key, &raw, &r)){
+		return NULL;
+	}
+	if (r.hash){
+		return ERR_WRONGTYPE;
+	}
+	*len = r.vlog ? vlog_length(&r) : r.len;
+	if (*len < 0){
+		return ERR_VLOG;
+	}
+	return NULL;
+}
+
+// APPEND replies with the length after the merge, or with --checked-merge
+// the length before it plus the appended bytes.
+error exec_append(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'append' command";
+	}
+	rocksdb::Slice key(c->args[1], c->args_size[1]);
+	int64_t len;
+	error e;
+	if (!checked_merge){
+		merge(key, MERGE_APPEND, c->args[2], c->args_size[2]);
+		e = string_len(key, &len);
+		if (e){
+			return e;
+		}
+		client_write_int(c, len);
+		return NULL;
+	}
+	e = string_len(key, &len);
+	if (e){
+		return e;
+	}
+	merge(key, MERGE_APPEND, c->args[2], c->args_size[2]);
+	client_write_int(c, len+c->args_size[2]);
+	return NULL;
+}
+
+// BLINDINCRBY and BLINDAPPEND only add the merge operand and reply +OK, the
+// write never reads. An increment of a value that isn't an integer, or that
+// would overflow, is dropped when the operands are merged.
+error exec_blindincrby(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'blindincrby' command";
+	}
+	int64_t delta;
+	if (!atoi64(c->args[2], c->args_size[2], &delta)){
+		return "value is not an integer or out of range";
+	}
+	merge(rocksdb::Slice(c->args[1], c->args_size[1]), MERGE_INCR,
+		c->args[2], c->args_size[2]);
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+error exec_blindappend(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'blindappend' command";
+	}
+	merge(rocksdb::Slice(c->args[1], c->args_size[1]), MERGE_APPEND,
+		c->args[2], c->args_size[2]);
+	client_write(c, "+OK\r\n", 5);
 	return NULL;
 }
 
@@ -90,6 +479,27 @@ error exec_flushdb(client *c){
 	if (c->args_len!=1){
 		return "wrong number of arguments for 'flushdb' command";
 	}
+	if (save_in_progress()){
+		return "Background save in progress";
+	}
+	if (ingest_in_progress()){
+		return "Ingest in progress";
+	}
+	if (vlog_busy()){
+		return "Value log compaction in progress";
+	}
+	if (dbsize_in_progress()){
+		return "Key count in progress";
+	}
+	if (scan_in_progress()){
+		return "KEYS in progress";
+	}
+	if (compact_in_progress()){
+		return "Compaction in progress";
+	}
+	if (warmup_in_progress()){
+		return "Cache warmup in progress";
+	}
 	flushdb();
 	client_write(c, "+OK\r\n", 5);
 	return NULL;
@@ -98,7 +508,7 @@ error exec_flushdb(client *c){
 static error exec_scan_keys(client *c, 
 		bool scan,
 		const char *pat, int pat_len, 
-		int cursor, int count
+		int64_t cursor, int count
 ){
 	if (count < 0){
 		count = 10;
@@ -106,6 +516,9 @@ static error exec_scan_keys(client *c,
 	if (cursor < 0){
 		cursor = 0;
 	}
+	// SCAN goes on with the iterator of its session.
+	scan_cursor *sc = scan ? cursor_get(cursor, pat, pat_len) : NULL;
+	cursor = cursor_position(cursor);
 
 	char *start = NULL;
 	char *end = NULL;
@@ -118,14 +531,19 @@ static error exec_scan_keys(client *c,
 	// to avoid double-buffering, prewrite some bytes and then we'll go back 
 	// and fill it in with correctness.
 	const int filler = 128;
+	int output_start = c->output_len;
 	for (int i=0;i<filler;i++){
 		client_write_byte(c, '?');
 	}
 	int total = 0;
-	int i = 0;
-	int ncursor = 0;
-	rocksdb::Iterator* it = db->NewIterator(rocksdb::ReadOptions());
-	if (star){
+	int64_t i = 0;
+	int64_t ncursor = 0;
+	int64_t now = now_ms();
+	rocksdb::ReadOptions read_options;
+	rocksdb::Iterator* it = sc ? sc->it : db_iterator(NULL, read_options);
+	if (sc && !sc->fresh){
+		i = sc->pos;
+	}else if (star){
 		it->SeekToFirst();
 	}else{
 		it->Seek(prefix);
@@ -139,6 +557,12 @@ static error exec_scan_keys(client *c,
 					break;
 				}
 			}
+			record r;
+			rocksdb::Slice value = it->value();
+			record_decode(value.data(), value.size(), &r);
+			if (record_expired(&r, now)){
+				continue;
+			}
 			if (i >= cursor){
 				if (scan&&total==count){
 					ncursor = i;
@@ -146,6 +570,10 @@ static error exec_scan_keys(client *c,
 				}
 				client_write_bulk(c, key.data(), key.size());
 				total++;	
+				if (c->overlimit){
+					// the reply is dropped and the client closed.
+					break;
+				}
 			}
 			i++;
 		}
@@ -161,21 +589,36 @@ static error exec_scan_keys(client *c,
 	if (!s.ok()){
 		err(1, "%s", s.ToString().c_str());	
 	}
-	delete it;
+	if (sc){
+		ncursor = cursor_next(sc, ncursor);
+	}else{
+		delete it;
+	}
 
+	if (c->overlimit){
+		// the output was dropped, filler and all.
+		return NULL;
+	}
 	// fill in the header and write from offset.
 	char nb[filler];
 	if (scan){
 		char cursor_s[32];
-		sprintf(cursor_s, "%d", ncursor);
+		sprintf(cursor_s, "%lld", (long long)ncursor);
 		sprintf(nb, "*2\r\n$%zu\r\n%s\r\n*%d\r\n", strlen(cursor_s), cursor_s, total);
 	}else{
 		sprintf(nb, "*%d\r\n", total);
 	}
 	int nbn = strlen(nb);
-	memcpy(c->output+filler-nbn, nb, nbn);
-	c->output_offset = filler-nbn;
-
+	if (output_start == 0){
+		memcpy(c->output+filler-nbn, nb, nbn);
+		c->output_offset = filler-nbn;
+	}else{
+		// there's output in front of the filler, close the gap instead.
+		memcpy(c->output+output_start, nb, nbn);
+		memmove(c->output+output_start+nbn, c->output+output_start+filler, 
+			c->output_len-output_start-filler);
+		c->output_len -= filler-nbn;
+	}
 	return NULL;
 }
 
@@ -186,67 +629,141 @@ error exec_keys(client *c){
 	if (argc!=2){
 		return "wrong number of arguments for 'keys' command";
 	}
+	if (keys_parallel(c, argv[1], argl[1])){
+		return NULL;
+	}
 	return exec_scan_keys(c, false, argv[1], argl[1], -1, -1);
 }
-error exec_scan(client *c){
+// parse_scan_options reads the [MATCH pattern] [COUNT count] options that
+// start at argument idx.
+error parse_scan_options(client *c, int idx, 
+		const char **pat, int *pat_len, int *count
+){
 	const char **argv = c->args;
 	int *argl = c->args_size;
 	int argc = c->args_len;
-	if (argc<2){
-		return "wrong number of arguments for 'scan' command";
-	}
-	int cursor = atop(argv[1], argl[1]);
-	if (cursor < 0){
-		return "invalid cursor";
-	}
-	int count = -1;
-	const char *pat = "*";
-	int pat_len = 1;
-
-	for (int i=2;i<argc;i++){
+	for (int i=idx;i<argc;i++){
 		if (islstr(c, i, "match")){
 			i++;
 			if (i==argc){
 				return "syntax error";
 			}
-			pat = argv[i];
-			pat_len = argl[i];
+			*pat = argv[i];
+			*pat_len = argl[i];
 		}else if (islstr(c, i, "count")){
 			i++;
 			if (i==argc){
 				return "syntax error";
 			}
-			count = atop(argv[i], argl[i]);
-			if (count < 0){
+			*count = atop(argv[i], argl[i]);
+			if (*count < 0){
 				return "value is not an integer or out of range";
 			}
 		}else{
 			return "syntax error";
 		}
 	}
+	return NULL;
+}
+
+error exec_scan(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc<2){
+		return "wrong number of arguments for 'scan' command";
+	}
+	int64_t cursor;
+	if (!atoi64(argv[1], argl[1], &cursor) || cursor < 0){
+		return "invalid cursor";
+	}
+	int count = -1;
+	const char *pat = "*";
+	int pat_len = 1;
+	error e = parse_scan_options(c, 2, &pat, &pat_len, &count);
+	if (e){
+		return e;
+	}
 	return exec_scan_keys(c, true, pat, pat_len, cursor, count);
 }
 
 
-error exec_command(client *c){
-	if (c->args_len==0||(c->args_len==1&&c->args_size[0]==0)){
+static const command commands[] = {
+	{"set", exec_set, CMD_WRITE},
+	{"setex", exec_setex, CMD_WRITE},
+	{"psetex", exec_psetex, CMD_WRITE},
+	{"get", exec_get, 0},
+	{"mget", exec_mget, 0},
+	{"mset", exec_mset, CMD_WRITE},
+	{"del", exec_del, CMD_WRITE},
+	{"expire", exec_expire, CMD_WRITE},
+	{"pexpire", exec_pexpire, CMD_WRITE},
+	{"ttl", exec_ttl, 0},
+	{"pttl", exec_pttl, 0},
+	{"persist", exec_persist, CMD_WRITE},
+	{"incr", exec_incr, CMD_WRITE},
+	{"decr", exec_decr, CMD_WRITE},
+	{"incrby", exec_incrby, CMD_WRITE},
+	{"decrby", exec_decrby, CMD_WRITE},
+	{"append", exec_append, CMD_WRITE},
+	{"blindincrby", exec_blindincrby, CMD_WRITE},
+	{"blindappend", exec_blindappend, CMD_WRITE},
+	{"hset", exec_hset, CMD_WRITE},
+	{"hget", exec_hget, 0},
+	{"hmget", exec_hmget, 0},
+	{"hdel", exec_hdel, CMD_WRITE},
+	{"hgetall", exec_hgetall, 0},
+	{"hscan", exec_hscan, 0},
+	{"multi", exec_multi, CMD_NOMULTI},
+	{"exec", exec_exec, CMD_NOQUEUE|CMD_WRITE},
+	{"discard", exec_discard, CMD_NOQUEUE},
+	{"watch", exec_watch, CMD_NOMULTI},
+	{"unwatch", exec_unwatch, 0},
+	{"quit", exec_quit, CMD_NOQUEUE},
+	{"info", exec_info, 0},
+	{"keys", exec_keys, 0},
+	{"scan", exec_scan, 0},
+	{"dbsize", exec_dbsize, CMD_NOMULTI},
+	{"rangesize", exec_rangesize, 0},
+	{"compact", exec_compact, CMD_NOMULTI},
+	{"flushdb", exec_flushdb, CMD_NOMULTI|CMD_WRITE},
+	{"save", exec_save, CMD_NOMULTI},
+	{"bgsave", exec_bgsave, CMD_NOMULTI},
+	{"lastsave", exec_lastsave, 0},
+	{"ingest", exec_ingest, CMD_NOMULTI|CMD_WRITE},
+	{"replicaof", exec_replicaof, CMD_NOMULTI},
+	{"psync", exec_psync, CMD_NOMULTI},
+	{"replfile", exec_replfile, CMD_NOMULTI},
+	{"replack", exec_replack, CMD_NOMULTI},
+	{NULL, NULL, 0},
+};
+
+const command *lookup_command(client *c){
+	if (c->args_len==0){
 		return NULL;
 	}
-	if (iscmd(c, "set")){
-		return exec_set(c);
-	}else if (iscmd(c, "get")){
-		return exec_get(c);
-	}else if (iscmd(c, "del")){
-		return exec_del(c);
-	}else if (iscmd(c, "quit")){
-		return exec_quit(c);
-	}else if (iscmd(c, "keys")){
-		return exec_keys(c);
-	}else if (iscmd(c, "scan")){
-		return exec_scan(c);
-	}else if (iscmd(c, "flushdb")){
-		return exec_flushdb(c);
+	for (const command *cmd=commands;cmd->name;cmd++){
+		if (iscmd(c, cmd->name)){
+			return cmd;
+		}
 	}
-	return client_err_unknown_command(c, c->args[0], c->args_size[0]);
+	return NULL;
 }
 
+error exec_command(client *c, const command *cmd){
+	if (c->args_len==0||(c->args_len==1&&c->args_size[0]==0)){
+		return NULL;
+	}
+	// EXEC only runs commands that were checked when they were queued.
+	if (cmd && (cmd->flags&CMD_WRITE) && !(cmd->flags&CMD_NOQUEUE) &&
+		repl_readonly(c)){
+		return "READONLY You can't write against a read only replica.";
+	}
+	if (multi_active(c)){
+		return multi_queue(c, cmd);
+	}
+	if (!cmd){
+		return client_err_unknown_command(c, c->args[0], c->args_size[0]);
+	}
+	return cmd->proc(c);
+}
@@ -0,0 +1,384 @@
+#include "server.h"
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+#include <rocksdb/filter_policy.h>
+#include <set>
+
+// Hash fields live in their own column family, one entry per field. The
+// composite key is the hash key prefixed by its length, followed by the field.
+//
+//   <key length:4 bytes big endian> <key> <field>
+//
+// The length prefix acts as the separator, so keys and fields may contain
+// any bytes. Every field of a hash shares the same prefix, which is what the
+// prefix extractor and the prefix bloom filters are built on.
+//
+// The hash key itself holds a marker record in the default column family, so
+// KEYS, SCAN, DBSIZE, TTL, EXPIRE and DEL see hashes like any other key, and
+// a hash command on a string key, or a string command on a hash, fails with
+// WRONGTYPE. SET overwrites the marker. Fields without a live marker, left
+// behind by a hash that expired or was overwritten, are never read and are
+// removed by the next HSET or DEL of the key.
+rocksdb::ColumnFamilyHandle *hashcf = NULL;
+
+static void hash_prefix(std::string *out, const char *key, int key_len){
+	out->clear();
+	out->push_back((char)(key_len>>24));
+	out->push_back((char)(key_len>>16));
+	out->push_back((char)(key_len>>8));
+	out->push_back((char)key_len);
+	out->append(key, key_len);
+}
+
+static void hash_field_key(std::string *out, const char *key, int key_len,
+		const char *field, int field_len
+){
+	hash_prefix(out, key, key_len);
+	out->append(field, field_len);
+}
+
+static int hash_prefix_len(const rocksdb::Slice &key){
+	if (key.size() < 4){
+		return -1;
+	}
+	const unsigned char *p = (const unsigned char *)key.data();
+	int n = (p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+	if (n < 0 || key.size()-4 < (size_t)n){
+		return -1;
+	}
+	return 4+n;
+}
+
+class hash_prefix_transform : public rocksdb::SliceTransform {
+public:
+	virtual const char *Name() const override {
+		return "RocksDBServerHashPrefix";
+	}
+	virtual rocksdb::Slice Transform(const rocksdb::Slice &key) const override {
+		return rocksdb::Slice(key.data(), hash_prefix_len(key));
+	}
+	virtual bool InDomain(const rocksdb::Slice &key) const override {
+		return hash_prefix_len(key) >= 0;
+	}
+	virtual bool InRange(const rocksdb::Slice &dst) const override {
+		return hash_prefix_len(dst) == (int)dst.size();
+	}
+};
+
+void hash_options(rocksdb::ColumnFamilyOptions *options){
+	options->merge_operator.reset();
+	options->compaction_filter = NULL;
+	options->prefix_extractor.reset(new hash_prefix_transform());
+	options->memtable_prefix_bloom_size_ratio = 0.1;
+	rocksdb::BlockBasedTableOptions table_options;
+	table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+	memory_table_options(&table_options);
+	options->table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+}
+
+// hash_iterator returns an iterator positioned at the first field of key.
+// it stays valid only while it's within the hash.
+static rocksdb::Iterator *hash_iterator(const std::string &prefix){
+	rocksdb::ReadOptions read_options;
+	read_options.prefix_same_as_start = true;
+	rocksdb::Iterator *it = db_key_iterator(hashcf, prefix, read_options);
+	it->Seek(prefix);
+	return it;
+}
+
+static void check_iterator(rocksdb::Iterator *it){
+	rocksdb::Status s = it->status();
+	if (!s.ok()){
+		err(1, "%s", s.ToString().c_str());
+	}
+}
+
+static bool hash_get(const std::string &key, std::string *value){
+	return db_get(hashcf, key, value);
+}
+
+// hash_key_of returns the hash key that a field entry belongs to.
+rocksdb::Slice hash_key_of(const rocksdb::Slice &fkey){
+	int n = hash_prefix_len(fkey);
+	if (n < 0){
+		return fkey;
+	}
+	return rocksdb::Slice(fkey.data()+4, n-4);
+}
+
+// hash_exists tells whether key is a live hash. Returns ERR_WRONGTYPE when
+// the key holds a string.
+static error hash_exists(const char *key, int key_len, bool *exists){
+	std::string raw;
+	*exists = false;
+	if (!db_get(NULL, rocksdb::Slice(key, key_len), &raw)){
+		return NULL;
+	}
+	record r;
+	record_decode(raw.data(), raw.size(), &r);
+	if (record_expired(&r, now_ms())){
+		return NULL;
+	}
+	if (!r.hash){
+		return ERR_WRONGTYPE;
+	}
+	*exists = true;
+	return NULL;
+}
+
+// hash_clear adds the deletion of every field of key to batch and returns
+// the number of fields.
+static int hash_clear(rocksdb::WriteBatch *batch, const char *key, int key_len){
+	std::string prefix;
+	hash_prefix(&prefix, key, key_len);
+	int n = 0;
+	rocksdb::Iterator *it = hash_iterator(prefix);
+	for (;it->Valid();it->Next()){
+		batch->Delete(hashcf, it->key());
+		n++;
+	}
+	check_iterator(it);
+	delete it;
+	return n;
+}
+
+// hash_delete removes every field of key and returns the number of fields
+// removed. The marker record is up to the caller.
+int hash_delete(const char *key, int key_len){
+	rocksdb::WriteBatch batch;
+	int n = hash_clear(&batch, key, key_len);
+	if (n){
+		db_write(&batch);
+	}
+	return n;
+}
+
+error exec_hset(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc<4 || argc%2!=0){
+		return "wrong number of arguments for 'hset' command";
+	}
+	bool exists;
+	error e = hash_exists(argv[1], argl[1], &exists);
+	if (e){
+		return e;
+	}
+	rocksdb::WriteBatch batch;
+	if (!exists){
+		hash_clear(&batch, argv[1], argl[1]);
+		std::string marker;
+		record_encode_hash(&marker, 0);
+		batch.Put(rocksdb::Slice(argv[1], argl[1]), marker);
+	}
+	std::string fkey, value;
+	std::set<std::string> seen;	// a field given twice is counted once
+	int n = 0;
+	for (int i=2;i<argc;i+=2){
+		hash_field_key(&fkey, argv[1], argl[1], argv[i], argl[i]);
+		if (seen.insert(fkey).second && (!exists || !hash_get(fkey, &value))){
+			n++;
+		}
+		batch.Put(hashcf, fkey, rocksdb::Slice(argv[i+1], argl[i+1]));
+	}
+	db_write(&batch);
+	client_write_int(c, n);
+	return NULL;
+}
+
+error exec_hget(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc!=3){
+		return "wrong number of arguments for 'hget' command";
+	}
+	bool exists;
+	error e = hash_exists(argv[1], argl[1], &exists);
+	if (e){
+		return e;
+	}
+	std::string fkey, value;
+	hash_field_key(&fkey, argv[1], argl[1], argv[2], argl[2]);
+	if (!exists || !hash_get(fkey, &value)){
+		client_write(c, "$-1\r\n", 5);
+		return NULL;
+	}
+	client_write_bulk(c, value.data(), value.size());
+	return NULL;
+}
+
+error exec_hmget(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc<3){
+		return "wrong number of arguments for 'hmget' command";
+	}
+	bool exists;
+	error e = hash_exists(argv[1], argl[1], &exists);
+	if (e){
+		return e;
+	}
+	std::string fkey, value;
+	client_write_multibulk(c, argc-2);
+	for (int i=2;i<argc;i++){
+		hash_field_key(&fkey, argv[1], argl[1], argv[i], argl[i]);
+		if (!exists || !hash_get(fkey, &value)){
+			client_write(c, "$-1\r\n", 5);
+		}else{
+			client_write_bulk(c, value.data(), value.size());
+		}
+	}
+	return NULL;
+}
+
+error exec_hdel(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc<3){
+		return "wrong number of arguments for 'hdel' command";
+	}
+	bool exists;
+	error e = hash_exists(argv[1], argl[1], &exists);
+	if (e){
+		return e;
+	}
+	if (!exists){
+		client_write(c, ":0\r\n", 4);
+		return NULL;
+	}
+	rocksdb::WriteBatch batch;
+	std::string fkey, value;
+	std::set<std::string> seen;
+	int n = 0;
+	for (int i=2;i<argc;i++){
+		hash_field_key(&fkey, argv[1], argl[1], argv[i], argl[i]);
+		if (seen.insert(fkey).second && hash_get(fkey, &value)){
+			batch.Delete(hashcf, fkey);
+			n++;
+		}
+	}
+	if (n){
+		// the hash goes away with its last field.
+		std::string prefix;
+		hash_prefix(&prefix, argv[1], argl[1]);
+		bool left = false;
+		rocksdb::Iterator *it = hash_iterator(prefix);
+		for (;it->Valid() && !left;it->Next()){
+			left = !seen.count(it->key().ToString());
+		}
+		check_iterator(it);
+		delete it;
+		if (!left){
+			batch.Delete(rocksdb::Slice(argv[1], argl[1]));
+		}
+		db_write(&batch);
+	}
+	client_write_int(c, n);
+	return NULL;
+}
+
+error exec_hgetall(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc!=2){
+		return "wrong number of arguments for 'hgetall' command";
+	}
+	bool exists;
+	error e = hash_exists(argv[1], argl[1], &exists);
+	if (e){
+		return e;
+	}
+	if (!exists){
+		client_write_multibulk(c, 0);
+		return NULL;
+	}
+	std::string prefix;
+	hash_prefix(&prefix, argv[1], argl[1]);
+	std::vector<std::string> items;
+	rocksdb::Iterator *it = hash_iterator(prefix);
+	for (;it->Valid();it->Next()){
+		rocksdb::Slice key = it->key();
+		items.push_back(std::string(key.data()+prefix.size(), 
+			key.size()-prefix.size()));
+		items.push_back(it->value().ToString());
+	}
+	check_iterator(it);
+	delete it;
+
+	client_write_multibulk(c, items.size());
+	for (size_t i=0;i<items.size();i++){
+		client_write_bulk(c, items[i].data(), items[i].size());
+	}
+	return NULL;
+}
+
+error exec_hscan(client *c){
+	const char **argv = c->args;
+	int *argl = c->args_size;
+	int argc = c->args_len;
+	if (argc<3){
+		return "wrong number of arguments for 'hscan' command";
+	}
+	int cursor = atop(argv[2], argl[2]);
+	if (cursor < 0){
+		return "invalid cursor";
+	}
+	const char *pat = "*";
+	int pat_len = 1;
+	int count = 10;
+	error e = parse_scan_options(c, 3, &pat, &pat_len, &count);
+	if (e){
+		return e;
+	}
+	bool exists;
+	e = hash_exists(argv[1], argl[1], &exists);
+	if (e){
+		return e;
+	}
+	if (!exists){
+		client_write_multibulk(c, 2);
+		client_write_bulk(c, "0", 1);
+		client_write_multibulk(c, 0);
+		return NULL;
+	}
+	std::string prefix;
+	hash_prefix(&prefix, argv[1], argl[1]);
+	std::vector<std::string> items;
+	int i = 0;
+	int ncursor = 0;
+	rocksdb::Iterator *it = hash_iterator(prefix);
+	for (;it->Valid();it->Next()){
+		rocksdb::Slice key = it->key();
+		const char *field = key.data()+prefix.size();
+		int field_len = key.size()-prefix.size();
+		if (!stringmatchlen(pat, pat_len, field, field_len, 1)){
+			continue;
+		}
+		if (i >= cursor){
+			if ((int)items.size() == count*2){
+				ncursor = i;
+				break;
+			}
+			items.push_back(std::string(field, field_len));
+			items.push_back(it->value().ToString());
+		}
+		i++;
+	}
+	check_iterator(it);
+	delete it;
+
+	char cursor_s[32];
+	sprintf(cursor_s, "%d", ncursor);
+	client_write_multibulk(c, 2);
+	client_write_bulk(c, cursor_s, strlen(cursor_s));
+	client_write_multibulk(c, items.size());
+	for (size_t j=0;j<items.size();j++){
+		client_write_bulk(c, items[j].data(), items[j].size());
+	}
+	return NULL;
+}
@@ -0,0 +1,446 @@
+#include "server.h"
+#include <rocksdb/sst_file_writer.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <queue>
+
+// rocksdb-server-import turns a dump of SET commands into sorted SST files
+// that the server links into the database with INGEST. Nothing goes through
+// the WAL or the memtable, and the files land directly in the lowest level
+// that they fit in.
+//
+// The input is sorted in chunks that fit in memory. Each sorted chunk is
+// spilled to a run file, and the runs are merged into the final SST files.
+// When the same key appears more than once, the last one in the input wins.
+
+typedef struct entry_t {
+	int shard;
+	std::string key;
+	std::string value;
+} entry;
+
+static const char *format = "resp";
+static const char *outdir = "import";
+static size_t chunk_size = 256*1024*1024;
+static size_t file_size = 256*1024*1024;
+static int64_t now = 0;
+int nshards = 1;
+
+static std::vector<entry> chunk;
+static size_t chunk_bytes = 0;
+static std::vector<std::string> runs;
+
+static uint64_t nkeys = 0;
+static int nfiles = 0;
+
+static bool entry_less(const entry &a, const entry &b){
+	if (a.shard != b.shard){
+		return a.shard < b.shard;
+	}
+	return a.key < b.key;
+}
+
+static void add(const char *key, int key_len, const char *val, int val_len,
+		int64_t expires
+){
+	chunk.push_back(entry());
+	entry &e = chunk.back();
+	e.shard = shard_of_key(key, key_len, nshards);
+	e.key.assign(key, key_len);
+	record_encode(&e.value, val, val_len, expires);
+	chunk_bytes += key_len+e.value.size()+sizeof(entry);
+}
+
+// sort_chunk sorts the chunk and drops all but the last value of each key.
+static void sort_chunk(){
+	std::stable_sort(chunk.begin(), chunk.end(), entry_less);
+	size_t n = 0;
+	for (size_t i=0;i<chunk.size();i++){
+		if (n && chunk[n-1].key == chunk[i].key){
+			n--;
+		}
+		if (n != i){
+			chunk[n].shard = chunk[i].shard;
+			chunk[n].key.swap(chunk[i].key);
+			chunk[n].value.swap(chunk[i].value);
+		}
+		n++;
+	}
+	chunk.resize(n);
+}
+
+static void write_string(FILE *f, const std::string &s){
+	uint32_t n = s.size();
+	if (fwrite(&n, 4, 1, f) != 1 || fwrite(s.data(), 1, n, f) != n){
+		err(1, "write run");
+	}
+}
+
+static bool read_string(FILE *f, std::string *s){
+	uint32_t n;
+	if (fread(&n, 4, 1, f) != 1){
+		return false;
+	}
+	s->resize(n);
+	if (n && fread(&(*s)[0], 1, n, f) != n){
+		err(1, "read run");
+	}
+	return true;
+}
+
+static void spill(){
+	sort_chunk();
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/run-%06zu.tmp", outdir, runs.size());
+	FILE *f = fopen(path, "wb");
+	if (!f){
+		err(1, "%s", path);
+	}
+	for (size_t i=0;i<chunk.size();i++){
+		if (fwrite(&chunk[i].shard, sizeof(int), 1, f) != 1){
+			err(1, "write run");
+		}
+		write_string(f, chunk[i].key);
+		write_string(f, chunk[i].value);
+	}
+	if (fclose(f)){
+		err(1, "%s", path);
+	}
+	runs.push_back(path);
+	chunk.clear();
+	chunk_bytes = 0;
+}
+
+static void maybe_spill(){
+	if (chunk_bytes >= chunk_size){
+		spill();
+	}
+}
+
+// sst writes the sorted entries into SST files of about file_size bytes.
+// With shards, each shard gets its own directory.
+static rocksdb::SstFileWriter *writer = NULL;
+static size_t writer_bytes = 0;
+static int writer_shard = 0;
+
+static void check_status(const rocksdb::Status &s){
+	if (!s.ok()){
+		errx(1, "%s", s.ToString().c_str());
+	}
+}
+
+static void sst_finish(){
+	if (!writer){
+		return;
+	}
+	check_status(writer->Finish());
+	delete writer;
+	writer = NULL;
+}
+
+static void sst_add(int shard, const std::string &key, const std::string &value){
+	if (writer && (writer_bytes >= file_size || writer_shard != shard)){
+		sst_finish();
+	}
+	if (!writer){
+		rocksdb::Options options;
+		writer = new rocksdb::SstFileWriter(rocksdb::EnvOptions(), options,
+			options.comparator);
+		std::string sdir = shard_path(outdir, shard);
+		if (mkdir(sdir.c_str(), 0755) && errno != EEXIST){
+			err(1, "%s", sdir.c_str());
+		}
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%06d.sst", sdir.c_str(), ++nfiles);
+		check_status(writer->Open(path));
+		writer_shard = shard;
+		writer_bytes = 0;
+	}
+	check_status(writer->Add(key, value));
+	writer_bytes += key.size()+value.size();
+	nkeys++;
+}
+
+typedef struct run_t {
+	FILE *f;
+	int idx;
+	int shard;
+	std::string key;
+	std::string value;
+} run;
+
+static bool run_next(run *r){
+	if (fread(&r->shard, sizeof(int), 1, r->f) != 1){
+		return false;
+	}
+	if (!read_string(r->f, &r->key) || !read_string(r->f, &r->value)){
+		errx(1, "truncated run file");
+	}
+	return true;
+}
+
+// run_greater orders the merge heap by shard and key, and puts later runs
+// first for equal keys so that the last value in the input wins.
+struct run_greater {
+	bool operator()(const run *a, const run *b) const {
+		if (a->shard != b->shard){
+			return a->shard > b->shard;
+		}
+		int cmp = a->key.compare(b->key);
+		if (cmp != 0){
+			return cmp > 0;
+		}
+		return a->idx < b->idx;
+	}
+};
+
+static void merge_runs(){
+	std::vector<run> rs(runs.size());
+	std::priority_queue<run*, std::vector<run*>, run_greater> heap;
+	for (size_t i=0;i<runs.size();i++){
+		rs[i].idx = i;
+		rs[i].f = fopen(runs[i].c_str(), "rb");
+		if (!rs[i].f){
+			err(1, "%s", runs[i].c_str());
+		}
+		if (run_next(&rs[i])){
+			heap.push(&rs[i]);
+		}
+	}
+	std::string last;
+	bool first = true;
+	while (!heap.empty()){
+		run *r = heap.top();
+		heap.pop();
+		if (first || r->key != last){
+			sst_add(r->shard, r->key, r->value);
+			last = r->key;
+			first = false;
+		}
+		if (run_next(r)){
+			heap.push(r);
+		}
+	}
+	for (size_t i=0;i<runs.size();i++){
+		fclose(rs[i].f);
+		unlink(runs[i].c_str());
+	}
+}
+
+// input is a buffered reader over one input file.
+typedef struct input_t {
+	FILE *f;
+	const char *name;
+	uint64_t line;
+	std::string buf;
+} input;
+
+static bool read_line(input *in){
+	in->buf.clear();
+	int ch;
+	while ((ch = getc(in->f)) != EOF){
+		if (ch == '\n'){
+			break;
+		}
+		in->buf.push_back((char)ch);
+	}
+	if (ch == EOF && in->buf.empty()){
+		if (ferror(in->f)){
+			err(1, "%s", in->name);
+		}
+		return false;
+	}
+	if (in->buf.size() && in->buf[in->buf.size()-1] == '\r'){
+		in->buf.resize(in->buf.size()-1);
+	}
+	in->line++;
+	return true;
+}
+
+static void bad_input(input *in, const char *msg){
+	errx(1, "%s:%llu: %s", in->name, (unsigned long long)in->line, msg);
+}
+
+// import_tsv reads "key<TAB>value" lines.
+static void import_tsv(input *in){
+	while (read_line(in)){
+		if (in->buf.empty()){
+			continue;
+		}
+		size_t tab = in->buf.find('\t');
+		if (tab == std::string::npos){
+			bad_input(in, "expected key<TAB>value");
+		}
+		add(in->buf.data(), tab, in->buf.data()+tab+1,
+			in->buf.size()-tab-1, 0);
+		maybe_spill();
+	}
+}
+
+static bool read_count(input *in, char type, int *n){
+	if (!read_line(in)){
+		return false;
+	}
+	if (in->buf.empty() || in->buf[0] != type){
+		bad_input(in, type == '*' ? "expected '*'" : "expected '$'");
+	}
+	*n = atop(in->buf.data()+1, in->buf.size()-1);
+	if (*n < 0){
+		bad_input(in, "invalid length");
+	}
+	return true;
+}
+
+static bool argis(const std::string &arg, const char *str){
+	return arg.size() == strlen(str) && !strncasecmp(arg.data(), str, arg.size());
+}
+
+// import_resp reads SET, SETEX and PSETEX commands in the RESP protocol, the
+// same format that is piped into redis-cli --pipe.
+static void import_resp(input *in){
+	std::vector<std::string> args;
+	int argc;
+	while (read_count(in, '*', &argc)){
+		args.resize(argc);
+		for (int i=0;i<argc;i++){
+			int n;
+			if (!read_count(in, '$', &n)){
+				bad_input(in, "unexpected end of input");
+			}
+			args[i].resize(n+2);
+			if (fread(&args[i][0], 1, n+2, in->f) != (size_t)n+2 ||
+				args[i][n] != '\r' || args[i][n+1] != '\n'){
+				bad_input(in, "invalid bulk data");
+			}
+			args[i].resize(n);
+			in->line++;
+		}
+		if (argc == 0){
+			continue;
+		}
+		int64_t expires = 0;
+		if (argis(args[0], "set") && argc == 3){
+			add(args[1].data(), args[1].size(), args[2].data(),
+				args[2].size(), 0);
+		}else if ((argis(args[0], "setex") || argis(args[0], "psetex")) &&
+			argc == 4){
+			int64_t unit = argis(args[0], "setex") ? 1000 : 1;
+			if (!atoi64(args[2].data(), args[2].size(), &expires) ||
+				expires <= 0 || expires > (INT64_MAX-now)/unit){
+				bad_input(in, "invalid expire time");
+			}
+			expires *= unit;
+			add(args[1].data(), args[1].size(), args[3].data(),
+				args[3].size(), now+expires);
+		}else{
+			bad_input(in, "only SET, SETEX and PSETEX can be imported");
+		}
+		maybe_spill();
+	}
+}
+
+static void import(FILE *f, const char *name){
+	input in;
+	in.f = f;
+	in.name = name;
+	in.line = 0;
+	if (strcmp(format, "tsv") == 0){
+		import_tsv(&in);
+	}else{
+		import_resp(&in);
+	}
+}
+
+static const char *next_arg(int argc, char **argv, int *i){
+	if (*i+1 == argc){
+		fprintf(stderr, "argument missing after: \"%s\"\n", argv[*i]);
+		exit(1);
+	}
+	return argv[++*i];
+}
+
+static size_t parse_mb(int argc, char **argv, int *i){
+	const char *str = next_arg(argc, argv, i);
+	int n = atop(str, strlen(str));
+	if (n <= 0){
+		fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", str, argv[*i-1]);
+		exit(1);
+	}
+	return (size_t)n*1024*1024;
+}
+
+int main(int argc, char **argv){
+	std::vector<const char*> inputs;
+	for (int i=1;i<argc;i++){
+		if (strcmp(argv[i], "-h")==0||
+			strcmp(argv[i], "--help")==0||
+			strcmp(argv[i], "-?")==0){
+			fprintf(stdout, "usage: %s [-f resp|tsv] [-o output_dir] [--chunk-mb n] [--file-mb n] [--shards n] [file ...]\n", argv[0]);
+			return 0;
+		}else if (strcmp(argv[i], "-f")==0){
+			format = next_arg(argc, argv, &i);
+			if (strcmp(format, "resp") && strcmp(format, "tsv")){
+				fprintf(stderr, "invalid option '%s' for argument: \"-f\"\n", format);
+				return 1;
+			}
+		}else if (strcmp(argv[i], "-o")==0){
+			outdir = next_arg(argc, argv, &i);
+		}else if (strcmp(argv[i], "--chunk-mb")==0){
+			chunk_size = parse_mb(argc, argv, &i);
+		}else if (strcmp(argv[i], "--file-mb")==0){
+			file_size = parse_mb(argc, argv, &i);
+		}else if (strcmp(argv[i], "--shards")==0){
+			const char *str = next_arg(argc, argv, &i);
+			nshards = atop(str, strlen(str));
+			if (nshards <= 0 || nshards > 256){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", str, argv[i-1]);
+				return 1;
+			}
+		}else if (argv[i][0] == '-' && argv[i][1]){
+			fprintf(stderr, "unknown option argument: \"%s\"\n", argv[i]);
+			return 1;
+		}else{
+			inputs.push_back(argv[i]);
+		}
+	}
+	if (mkdir(outdir, 0755) && errno != EEXIST){
+		err(1, "%s", outdir);
+	}
+	now = now_ms();
+	if (inputs.empty()){
+		inputs.push_back("-");
+	}
+	for (size_t i=0;i<inputs.size();i++){
+		if (strcmp(inputs[i], "-") == 0){
+			import(stdin, "stdin");
+			continue;
+		}
+		FILE *f = fopen(inputs[i], "rb");
+		if (!f){
+			err(1, "%s", inputs[i]);
+		}
+		import(f, inputs[i]);
+		fclose(f);
+	}
+	if (runs.empty()){
+		sort_chunk();
+		for (size_t i=0;i<chunk.size();i++){
+			sst_add(chunk[i].shard, chunk[i].key, chunk[i].value);
+		}
+	}else{
+		if (chunk.size()){
+			spill();
+		}
+		merge_runs();
+	}
+	sst_finish();
+	if (nshards > 1 && !write_shards(outdir)){
+		err(1, "%s", outdir);
+	}
+	fprintf(stderr, "imported %llu keys into %d files in %s\n",
+		(unsigned long long)nkeys, nfiles, outdir);
+	return 0;
+}
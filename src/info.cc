@@ -0,0 +1,67 @@
+#include "server.h"
+
+static void info_server(std::string *out){
+	char buf[512];
+	snprintf(buf, sizeof(buf),
+		"# Server\r\n"
+		"server_version:" SERVER_VERSION "\r\n"
+		"rocksdb_version:" ROCKSDB_VERSION "\r\n"
+		"libuv_version:" LIBUV_VERSION "\r\n"
+		"process_id:%d\r\n"
+		"tcp_port:%d\r\n"
+		"unixsocket:%s\r\n"
+		"io_backend:%s\r\n"
+		"uptime_in_seconds:%lld\r\n"
+		"data_path:%s\r\n",
+		(int)getpid(), tcp_port, unixsocket ? unixsocket : "",
+		use_uring ? "uring" : "libuv",
+		(long long)(time(NULL)-start_time), dir);
+	out->append(buf);
+}
+
+static void info_clients(std::string *out){
+	char buf[128];
+	snprintf(buf, sizeof(buf),
+		"# Clients\r\n"
+		"connected_clients:%d\r\n",
+		nclients);
+	out->append(buf);
+}
+
+// sections in the order that they're reported.
+static const struct {
+	const char *name;
+	void (*proc)(std::string *out);
+} sections[] = {
+	{"server", info_server},
+	{"clients", info_clients},
+	{"memory", memory_info},
+	{"scheduler", sched_info},
+	{"persistence", save_info},
+	{"replication", repl_info},
+	{"keyspace", dbsize_info},
+	{"cursors", cursor_info},
+	{"stall", stall_info},
+	{"compaction", compact_info},
+	{"vlog", vlog_info},
+	{NULL, NULL},
+};
+
+error exec_info(client *c){
+	if (c->args_len>2){
+		return "wrong number of arguments for 'info' command";
+	}
+	std::string out;
+	for (int i=0;sections[i].name;i++){
+		if (c->args_len==2 && !islstr(c, 1, sections[i].name) &&
+			!islstr(c, 1, "all")){
+			continue;
+		}
+		if (out.size()){
+			out.append("\r\n");
+		}
+		sections[i].proc(&out);
+	}
+	client_write_bulk(c, out.data(), out.size());
+	return NULL;
+}
@@ -0,0 +1,178 @@
+#include "server.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <algorithm>
+
+// INGEST links SST files built by rocksdb-server-import into the database.
+// The files are moved into the database directory, a hard link when it's on
+// the same filesystem, and placed in the lowest level that they fit in. The
+// ingestion runs on the thread pool, the client gets its reply when it's done.
+// With shards, the import has a directory for each shard. Clients can only
+// ingest from below --ingestdir, the import directory by default.
+const char *ingestdir = "import";
+
+typedef struct ingest_job_t {
+	uv_work_t req;
+	client *c;
+	std::vector<std::vector<std::string> > files;	// per shard
+	size_t nfiles;
+	rocksdb::Status status;
+} ingest_job;
+
+static int ingesting = 0;
+
+bool ingest_in_progress(){
+	return ingesting > 0;
+}
+
+// ingest_files adds path to files. Directories add the SST files that they
+// contain, in name order.
+static error ingest_files(client *c, const std::string &path,
+		std::vector<std::string> *files
+){
+	struct stat st;
+	if (stat(path.c_str(), &st)){
+		client_err_alloc(c, path.size()+64);
+		sprintf(c->tmp_err, "no such file or directory '%s'", path.c_str());
+		return c->tmp_err;
+	}
+	if (!S_ISDIR(st.st_mode)){
+		files->push_back(path);
+		return NULL;
+	}
+	DIR *d = opendir(path.c_str());
+	if (!d){
+		return "could not read the directory";
+	}
+	std::vector<std::string> names;
+	struct dirent *ent;
+	while ((ent = readdir(d))){
+		size_t n = strlen(ent->d_name);
+		if (n > 4 && strcmp(ent->d_name+n-4, ".sst") == 0){
+			names.push_back(ent->d_name);
+		}
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+	for (size_t i=0;i<names.size();i++){
+		files->push_back(path+"/"+names[i]);
+	}
+	return NULL;
+}
+
+// shard_files adds the files that rocksdb-server-import built for each
+// shard under path.
+static error shard_files(client *c, const std::string &path,
+		std::vector<std::vector<std::string> > *files
+){
+	FILE *f = fopen((path+"/SHARDS").c_str(), "r");
+	int n = 0;
+	if (f){
+		if (fscanf(f, "%d", &n) != 1){
+			n = 0;
+		}
+		fclose(f);
+	}
+	if (n != nshards){
+		client_err_alloc(c, path.size()+128);
+		sprintf(c->tmp_err, "'%s' was not imported with --shards %d",
+			path.c_str(), nshards);
+		return c->tmp_err;
+	}
+	for (int i=0;i<nshards;i++){
+		std::string spath = shard_path(path.c_str(), i);
+		struct stat st;
+		if (stat(spath.c_str(), &st)){
+			continue;
+		}
+		error err = ingest_files(c, spath, &(*files)[i]);
+		if (err){
+			return err;
+		}
+	}
+	return NULL;
+}
+
+static void on_ingest_work(uv_work_t *req){
+	ingest_job *job = (ingest_job*)req->data;
+	rocksdb::IngestExternalFileOptions options;
+	options.move_files = true;
+	for (int i=0;i<nshards && job->status.ok();i++){
+		if (job->files[i].size()){
+			job->status = shards[i].db->IngestExternalFile(job->files[i],
+				options);
+		}
+	}
+}
+
+static void on_ingest_work_done(uv_work_t *req, int){
+	ingest_job *job = (ingest_job*)req->data;
+	client *c = job->c;
+	ingesting--;
+	if (job->status.ok()){
+		// any key might have changed, and the files aren't in the WAL.
+		touch_all_keys();
+		repl_resync();
+		log('*', "Ingested %zu files", job->nfiles);
+		client_write_int(c, job->nfiles);
+	}else{
+		std::string msg = "ingest failed: "+job->status.ToString();
+		log('#', "%s", msg.c_str());
+		client_write_error(c, msg.c_str());
+	}
+	delete job;
+	client_unblock(c);
+}
+
+error exec_ingest(client *c){
+	if (inmem){
+		return "ingesting is not supported with --inmem";
+	}
+	if (save_in_progress()){
+		// a checkpoint for a save or a replica is being created.
+		return "Background save in progress";
+	}
+	// without paths the whole ingest directory is ingested.
+	std::vector<std::string> paths;
+	if (c->args_len == 1){
+		paths.push_back(ingestdir);
+	}
+	for (int i=1;i<c->args_len;i++){
+		std::string path;
+		if (!subpath(ingestdir, c->args[i], c->args_size[i], &path)){
+			return "the ingest path must be relative to the ingest directory";
+		}
+		paths.push_back(path);
+	}
+	std::vector<std::vector<std::string> > files(nshards);
+	for (size_t i=0;i<paths.size();i++){
+		const std::string &path = paths[i];
+		error err;
+		if (nshards == 1){
+			err = ingest_files(c, path, &files[0]);
+		}else{
+			err = shard_files(c, path, &files);
+		}
+		if (err){
+			return err;
+		}
+	}
+	size_t nfiles = 0;
+	for (int i=0;i<nshards;i++){
+		nfiles += files[i].size();
+	}
+	if (nfiles == 0){
+		client_write_int(c, 0);
+		return NULL;
+	}
+	ingest_job *job = new ingest_job();
+	job->req.data = job;
+	job->c = c;
+	job->files.swap(files);
+	job->nfiles = nfiles;
+	ingesting++;
+	client_block(c);
+	uv_queue_work(loop, &job->req, on_ingest_work, on_ingest_work_done);
+	return NULL;
+}
@@ -0,0 +1,157 @@
+#include "server.h"
+#include <rocksdb/cache.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_buffer_manager.h>
+
+// With --maxmemory the server splits one budget between RocksDB and the
+// clients: half goes to a block cache shared by all shards and column
+// families, which also holds the index and filter blocks, a quarter to the
+// memtables of all shards through a shared write buffer manager, and a
+// quarter to the read and output buffers of the clients.
+//
+// A client whose replies pile up beyond --client-output-limit, by default the
+// client quarter, is disconnected. Before that, a client stops running
+// commands until its replies are written once they reach half the limit, or
+// while the client buffers are over their quarter, so a pipeline waits for
+// its slow reader instead of growing the buffers.
+int64_t maxmemory = 0;
+int64_t client_output_limit = 0;
+int64_t client_memory = 0;
+
+static std::shared_ptr<rocksdb::Cache> cache;
+static std::shared_ptr<rocksdb::WriteBufferManager> write_buffers;
+static uint64_t clients_over_limit = 0;
+static uint64_t clients_throttled = 0;
+
+// a single memtable is never larger than RocksDB's default.
+const size_t MEMTABLE_MAX = 64*1024*1024;
+const size_t MEMTABLE_MIN = 1024*1024;
+
+void memory_table_options(rocksdb::BlockBasedTableOptions *table_options){
+	if (!cache){
+		return;
+	}
+	table_options->block_cache = cache;
+	table_options->cache_index_and_filter_blocks = true;
+	table_options->pin_l0_filter_and_index_blocks_in_cache = true;
+}
+
+void memory_options(rocksdb::Options *options){
+	if (maxmemory <= 0){
+		return;
+	}
+	if (!cache){
+		cache = rocksdb::NewLRUCache(maxmemory/2);
+		write_buffers.reset(new rocksdb::WriteBufferManager(maxmemory/4));
+	}
+	options->write_buffer_manager = write_buffers;
+	// every column family of every shard can hold its memtables at once.
+	size_t size = maxmemory/4/(2*nshards*options->max_write_buffer_number);
+	if (size > MEMTABLE_MAX){
+		size = MEMTABLE_MAX;
+	}
+	if (size < MEMTABLE_MIN){
+		size = MEMTABLE_MIN;
+	}
+	options->write_buffer_size = size;
+	rocksdb::BlockBasedTableOptions table_options;
+	memory_table_options(&table_options);
+	options->table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+}
+
+static int64_t output_limit(){
+	if (client_output_limit > 0){
+		return client_output_limit;
+	}
+	return maxmemory/4;
+}
+
+// memory_output_allowed returns false when a reply would take the output of
+// the client over the limit. Replicas aren't limited.
+bool memory_output_allowed(client *c, size_t size){
+	int64_t limit = output_limit();
+	if (limit <= 0 || c->replica || c->primary || (int64_t)size <= limit){
+		return true;
+	}
+	if (!c->overlimit){
+		c->overlimit = 1;
+		clients_over_limit++;
+		log('#', "Closing a client over the output limit of %lld bytes",
+			(long long)limit);
+	}
+	return false;
+}
+
+// memory_throttle returns true when the client should wait for its replies
+// to be written before running more commands: when it has replies and the
+// client buffers are over budget, or its own replies reach half its limit.
+bool memory_throttle(client *c){
+	if (c->output_len == 0 || c->primary){
+		return false;
+	}
+	int64_t limit = output_limit();
+	if ((maxmemory <= 0 || client_memory <= maxmemory/4) &&
+		(limit <= 0 || c->replica || c->output_len < limit/2)){
+		return false;
+	}
+	clients_throttled++;
+	return true;
+}
+
+static uint64_t int_property(const char *name){
+	uint64_t total = 0;
+	for (int i=0;i<nshards;i++){
+		rocksdb::ColumnFamilyHandle *cfs[] = {
+			shards[i].db->DefaultColumnFamily(), shards[i].hashcf,
+		};
+		for (int j=0;j<2;j++){
+			uint64_t n;
+			if (shards[i].db->GetIntProperty(cfs[j], name, &n)){
+				total += n;
+			}
+		}
+	}
+	return total;
+}
+
+static uint64_t rss(){
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f){
+		if (fscanf(f, "%*s %ld", &pages) != 1){
+			pages = 0;
+		}
+		fclose(f);
+	}
+	return (uint64_t)pages*sysconf(_SC_PAGESIZE);
+}
+
+void memory_info(std::string *out){
+	char buf[1024];
+	snprintf(buf, sizeof(buf),
+		"# Memory\r\n"
+		"used_memory_rss:%llu\r\n"
+		"maxmemory:%lld\r\n"
+		"block_cache_capacity:%llu\r\n"
+		"block_cache_usage:%llu\r\n"
+		"block_cache_pinned_usage:%llu\r\n"
+		"memtable_budget:%llu\r\n"
+		"memtable_usage:%llu\r\n"
+		"table_readers_usage:%llu\r\n"
+		"client_buffers_budget:%lld\r\n"
+		"client_buffers_usage:%lld\r\n"
+		"client_output_limit:%lld\r\n"
+		"clients_over_output_limit:%llu\r\n"
+		"clients_throttled:%llu\r\n",
+		(unsigned long long)rss(), (long long)maxmemory,
+		(unsigned long long)(cache ? cache->GetCapacity() : 0),
+		(unsigned long long)(cache ? cache->GetUsage() : 0),
+		(unsigned long long)(cache ? cache->GetPinnedUsage() : 0),
+		(unsigned long long)(write_buffers ? write_buffers->buffer_size() : 0),
+		(unsigned long long)int_property("rocksdb.cur-size-all-mem-tables"),
+		(unsigned long long)int_property("rocksdb.estimate-table-readers-mem"),
+		(long long)(maxmemory/4), (long long)client_memory,
+		(long long)output_limit(), (unsigned long long)clients_over_limit,
+		(unsigned long long)clients_throttled);
+	out->append(buf);
+}
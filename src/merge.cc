@@ -0,0 +1,112 @@
+#include "server.h"
+
+// Merge operands are tagged by their first byte and apply to the payload of
+// the stored record, keeping its expiration. Counters are stored as decimal
+// strings so that GET returns the same thing that Redis would.
+//
+//   'i' <int64 decimal>  add to the integer value
+//   'a' <bytes>          append to the string value
+const char MERGE_INCR = 'i';
+const char MERGE_APPEND = 'a';
+
+// merge_apply applies one operand to value, returns false when it's malformed.
+bool merge_apply(std::string *value, const rocksdb::Slice &op){
+	if (op.size() == 0){
+		return false;
+	}
+	const char *data = op.data()+1;
+	int len = op.size()-1;
+	switch (op[0]){
+	case MERGE_INCR: {
+		int64_t delta, n = 0;
+		if (!atoi64(data, len, &delta)){
+			return false;
+		}
+		if (value->size() && !atoi64(value->data(), value->size(), &n)){
+			// not an integer, the increment is ignored.
+			return true;
+		}
+		if ((delta > 0 && n > INT64_MAX-delta) ||
+			(delta < 0 && n < INT64_MIN-delta)){
+			// overflow, the increment is ignored.
+			return true;
+		}
+		char nb[32];
+		sprintf(nb, "%lld", (long long)(n+delta));
+		value->assign(nb);
+		return true;
+	}
+	case MERGE_APPEND:
+		value->append(data, len);
+		return true;
+	}
+	return false;
+}
+
+class merge_operator : public rocksdb::MergeOperator {
+public:
+	virtual bool FullMergeV2(const MergeOperationInput &in,
+			MergeOperationOutput *out) const override {
+		std::string value;
+		int64_t expires = 0;
+		if (in.existing_value){
+			record r;
+			std::string buf;
+			record_decode(in.existing_value->data(), 
+				in.existing_value->size(), &r);
+			if (r.hash && !record_expired(&r, now_ms())){
+				// not a string, the operands are dropped.
+				out->new_value.assign(in.existing_value->data(),
+					in.existing_value->size());
+				return true;
+			}
+			if (!r.hash && !record_expired(&r, now_ms()) &&
+				vlog_resolve(&r, &buf)){
+				value.assign(r.data, r.len);
+				expires = r.expires;
+			}
+		}
+		for (size_t i=0;i<in.operand_list.size();i++){
+			if (!merge_apply(&value, in.operand_list[i])){
+				return false;
+			}
+		}
+		record_encode(&out->new_value, value.data(), value.size(), expires);
+		return true;
+	}
+	virtual bool PartialMerge(const rocksdb::Slice &,
+			const rocksdb::Slice &left, const rocksdb::Slice &right,
+			std::string *new_value, rocksdb::Logger *) const override {
+		if (left.size() == 0 || right.size() == 0 || left[0] != right[0]){
+			return false;
+		}
+		switch (left[0]){
+		case MERGE_INCR: {
+			int64_t a, b;
+			if (!atoi64(left.data()+1, left.size()-1, &a) ||
+				!atoi64(right.data()+1, right.size()-1, &b)){
+				return false;
+			}
+			if ((b > 0 && a > INT64_MAX-b) || (b < 0 && a < INT64_MIN-b)){
+				return false;
+			}
+			char nb[32];
+			sprintf(nb, "%c%lld", MERGE_INCR, (long long)(a+b));
+			new_value->assign(nb);
+			return true;
+		}
+		case MERGE_APPEND:
+			new_value->assign(left.data(), left.size());
+			new_value->append(right.data()+1, right.size()-1);
+			return true;
+		}
+		return false;
+	}
+	virtual const char *Name() const override {
+		return "RocksDBServerMergeOperator";
+	}
+};
+
+rocksdb::MergeOperator *merge_operator_new(){
+	return new merge_operator();
+}
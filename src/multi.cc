@@ -0,0 +1,234 @@
+#include "server.h"
+#include <unordered_map>
+
+// tx_t is the per client transaction state. It's allocated on the first
+// MULTI or WATCH and lives until the client is freed.
+struct tx_t {
+	bool multi;		// between MULTI and EXEC/DISCARD
+	bool aborted;	// a command could not be queued
+	bool dirty;		// a watched key was modified
+	std::vector<std::string> args;	// queued arguments, flattened
+	std::vector<int> argc;			// number of arguments per command
+	std::vector<std::string> watched;
+};
+
+// watched_keys maps each watched key to the clients watching it. Writes
+// mark those clients dirty, which makes their next EXEC fail.
+static std::unordered_map<std::string, std::vector<client*> > watched_keys;
+
+static tx_t *tx_get(client *c){
+	if (!c->tx){
+		c->tx = new tx_t();
+	}
+	return c->tx;
+}
+
+static void tx_reset(tx_t *tx){
+	tx->multi = false;
+	tx->aborted = false;
+	tx->args.clear();
+	tx->argc.clear();
+}
+
+static void unwatch_all(client *c){
+	if (!c->tx){
+		return;
+	}
+	tx_t *tx = c->tx;
+	for (size_t i=0;i<tx->watched.size();i++){
+		auto it = watched_keys.find(tx->watched[i]);
+		if (it == watched_keys.end()){
+			continue;
+		}
+		std::vector<client*> &clients = it->second;
+		for (size_t j=0;j<clients.size();j++){
+			if (clients[j] == c){
+				clients.erase(clients.begin()+j);
+				break;
+			}
+		}
+		if (clients.empty()){
+			watched_keys.erase(it);
+		}
+	}
+	tx->watched.clear();
+	tx->dirty = false;
+}
+
+void multi_free(client *c){
+	if (!c->tx){
+		return;
+	}
+	unwatch_all(c);
+	delete c->tx;
+	c->tx = NULL;
+}
+
+bool multi_active(client *c){
+	return c->tx && c->tx->multi;
+}
+
+bool watching(){
+	return !watched_keys.empty();
+}
+
+// touch_key marks the clients watching key as dirty. Writes to a hash field
+// touch the hash key.
+void touch_key(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key){
+	if (watched_keys.empty()){
+		return;
+	}
+	rocksdb::Slice k = key;
+	if (cf == hashcf){
+		k = hash_key_of(key);
+	}
+	auto it = watched_keys.find(k.ToString());
+	if (it == watched_keys.end()){
+		return;
+	}
+	for (size_t i=0;i<it->second.size();i++){
+		it->second[i]->tx->dirty = true;
+	}
+}
+
+void touch_all_keys(){
+	for (auto it=watched_keys.begin();it!=watched_keys.end();it++){
+		for (size_t i=0;i<it->second.size();i++){
+			it->second[i]->tx->dirty = true;
+		}
+	}
+}
+
+// multi_queue is called for every command received between MULTI and
+// EXEC/DISCARD.
+error multi_queue(client *c, const command *cmd){
+	tx_t *tx = c->tx;
+	if (!cmd){
+		tx->aborted = true;
+		return client_err_unknown_command(c, c->args[0], c->args_size[0]);
+	}
+	if (cmd->flags&CMD_NOQUEUE){
+		return cmd->proc(c);
+	}
+	if (cmd->flags&CMD_NOMULTI){
+		return client_err_inside_multi(c, c->args[0], c->args_size[0]);
+	}
+	for (int i=0;i<c->args_len;i++){
+		tx->args.push_back(std::string(c->args[i], c->args_size[i]));
+	}
+	tx->argc.push_back(c->args_len);
+	client_write(c, "+QUEUED\r\n", 9);
+	return NULL;
+}
+
+error exec_multi(client *c){
+	if (c->args_len!=1){
+		return "wrong number of arguments for 'multi' command";
+	}
+	tx_get(c)->multi = true;
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+error exec_discard(client *c){
+	if (c->args_len!=1){
+		return "wrong number of arguments for 'discard' command";
+	}
+	if (!multi_active(c)){
+		return "DISCARD without MULTI";
+	}
+	tx_reset(c->tx);
+	unwatch_all(c);
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+// exec_exec runs the queued commands against a single snapshot and applies
+// all of their writes as one WriteBatch.
+error exec_exec(client *c){
+	if (c->args_len!=1){
+		return "wrong number of arguments for 'exec' command";
+	}
+	if (!multi_active(c)){
+		return "EXEC without MULTI";
+	}
+	tx_t *tx = c->tx;
+	if (tx->aborted){
+		tx_reset(tx);
+		unwatch_all(c);
+		return "EXECABORT Transaction discarded because of previous errors.";
+	}
+	if (tx->dirty){
+		tx_reset(tx);
+		unwatch_all(c);
+		client_write(c, "*-1\r\n", 5);
+		return NULL;
+	}
+	unwatch_all(c);
+
+	// point the client arguments at the queued commands, one at a time.
+	std::vector<std::string> args;
+	std::vector<int> argc;
+	args.swap(tx->args);
+	argc.swap(tx->argc);
+	tx_reset(tx);
+	const char **args_save = c->args;
+	int *args_size_save = c->args_size;
+	int args_len_save = c->args_len;
+	std::vector<const char*> argv(args.size());
+	std::vector<int> argl(args.size());
+	for (size_t i=0;i<args.size();i++){
+		argv[i] = args[i].data();
+		argl[i] = args[i].size();
+	}
+	client_write_multibulk(c, argc.size());
+	db_begin();
+	size_t idx = 0;
+	for (size_t i=0;i<argc.size();i++){
+		c->args = argv.data()+idx;
+		c->args_size = argl.data()+idx;
+		c->args_len = argc[i];
+		idx += argc[i];
+		error err = lookup_command(c)->proc(c);
+		if (err){
+			client_write_error(c, err);
+		}
+	}
+	db_commit();
+	c->args = args_save;
+	c->args_size = args_size_save;
+	c->args_len = args_len_save;
+	return NULL;
+}
+
+error exec_watch(client *c){
+	if (c->args_len<2){
+		return "wrong number of arguments for 'watch' command";
+	}
+	tx_t *tx = tx_get(c);
+	for (int i=1;i<c->args_len;i++){
+		std::string key(c->args[i], c->args_size[i]);
+		bool found = false;
+		for (size_t j=0;j<tx->watched.size();j++){
+			if (tx->watched[j] == key){
+				found = true;
+				break;
+			}
+		}
+		if (!found){
+			tx->watched.push_back(key);
+			watched_keys[key].push_back(c);
+		}
+	}
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+error exec_unwatch(client *c){
+	if (c->args_len!=1){
+		return "wrong number of arguments for 'unwatch' command";
+	}
+	unwatch_all(c);
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
@@ -0,0 +1,1010 @@
+#include "server.h"
+#include <rocksdb/transaction_log.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+
+// Asynchronous replication. A replica connects to the primary and sends
+//
+//   PSYNC <replid> <seq>[,<seq>...]
+//
+// where replid names the history of its data and each seq is the next
+// sequence number that it needs from a shard. When the primary still has the
+// WAL from there on, it replies CONTINUE and streams every WriteBatch since
+// then as
+//
+//   BATCH <shard> <seq> <batch>
+//
+// Otherwise it replies FULLSYNC <replid> <file...> with the files of a fresh
+// checkpoint, which the replica pulls with REPLFILE, loads in place of its
+// own database and then continues with another PSYNC. Sequence numbers are
+// the replication offsets, a replica that applies every batch in order ends
+// up with the same sequence numbers as the primary.
+//
+// The primary sends PING <offset> every second, replicas answer with
+// REPLACK <offset> so both sides can report the lag. The offset is the sum
+// of the sequence numbers of all shards.
+char replid[41];
+const char *primary_host = NULL;
+int primary_port = 0;
+
+// a replica as seen from the primary.
+typedef struct replica_t {
+	client *c;
+	bool online;		// streaming batches
+	char addr[64];
+	std::string sync_dir;
+	std::vector<rocksdb::TransactionLogIterator*> it;	// per shard
+	std::vector<uint64_t> next_seq;
+	uint64_t ack_seq;
+	uint64_t ack_time;
+	int jobs;	// jobs on the thread pool that hold on to the replica
+} replica;
+
+static std::vector<replica*> replicas;
+
+// the link to the primary as seen from a replica.
+const int LINK_NONE = 0;
+const int LINK_CONNECTING = 1;
+const int LINK_SYNC = 2;		// PSYNC sent
+const int LINK_TRANSFER = 3;	// pulling the checkpoint files
+const int LINK_LOADING = 4;		// waiting to load the checkpoint
+const int LINK_ONLINE = 5;		// applying batches
+
+static client *primary_link = NULL;
+static uv_getaddrinfo_t *link_resolver = NULL;
+static int link_state = LINK_NONE;
+static uint64_t link_io = 0;
+static uint64_t link_primary_seq = 0;
+static std::string sync_dir;
+static std::string sync_replid;
+static std::vector<std::string> sync_files;
+static size_t sync_idx = 0;
+static uint64_t sync_offset = 0;
+static uint64_t sync_bytes = 0;
+static FILE *sync_fp = NULL;
+
+static uv_timer_t repl_timer;
+static uv_check_t repl_check;
+
+// replicas are sent this much output at most before waiting for it to be
+// written.
+const int REPL_OUTPUT_LIMIT = 8*1024*1024;
+const int REPL_CHUNK_SIZE = 1024*1024;
+const int REPL_TIMEOUT_MS = 60*1000;
+
+void repl_options(rocksdb::Options *options){
+	// keep the WAL around for replicas that reconnect.
+	options->WAL_ttl_seconds = 60*60;
+	options->WAL_size_limit_MB = 1024;
+}
+
+static std::string id_path(){
+	return std::string(dir)+"/REPLID";
+}
+
+static void write_id(){
+	if (inmem){
+		return;
+	}
+	std::string path = id_path();
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f || fputs(replid, f) < 0 || fclose(f)){
+		err(1, "%s", path.c_str());
+	}
+}
+
+static void new_id(){
+	unsigned char buf[20];
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)){
+		err(1, "/dev/urandom");
+	}
+	close(fd);
+	for (int i=0;i<20;i++){
+		sprintf(replid+i*2, "%02x", buf[i]);
+	}
+	write_id();
+}
+
+// repl_open loads the replication id of the database, a new database gets a
+// new one.
+void repl_open(){
+	FILE *f = inmem ? NULL : fopen(id_path().c_str(), "r");
+	if (f){
+		size_t n = fread(replid, 1, 40, f);
+		fclose(f);
+		replid[n] = 0;
+		if (n == 40){
+			return;
+		}
+	}
+	new_id();
+}
+
+static uint64_t latest_seq(int i){
+	return shards[i].db->GetLatestSequenceNumber();
+}
+
+static uint64_t latest_offset(){
+	uint64_t offset = 0;
+	for (int i=0;i<nshards;i++){
+		offset += latest_seq(i);
+	}
+	return offset;
+}
+
+static void delete_iterators(replica *r){
+	for (size_t i=0;i<r->it.size();i++){
+		delete r->it[i];
+		r->it[i] = NULL;
+	}
+}
+
+static bool parse_seq(client *c, int idx, uint64_t *seq){
+	int64_t n;
+	if (!atoi64(c->args[idx], c->args_size[idx], &n) || n < 0){
+		return false;
+	}
+	*seq = n;
+	return true;
+}
+
+static void write_seq(client *c, uint64_t seq){
+	char buf[32];
+	int n = sprintf(buf, "%llu", (unsigned long long)seq);
+	client_write_bulk(c, buf, n);
+}
+
+static void remove_sync_dir(replica *r){
+	if (r->sync_dir.size()){
+		remove_directory(r->sync_dir.c_str(), 1);
+		r->sync_dir.clear();
+	}
+}
+
+// replica_free drops a replica whose client is closing. While a job on the
+// thread pool holds on to it, it's only detached from the client and the job
+// frees it, see replica_release.
+static void replica_free(replica *r){
+	for (size_t i=0;i<replicas.size();i++){
+		if (replicas[i] == r){
+			replicas.erase(replicas.begin()+i);
+			break;
+		}
+	}
+	delete_iterators(r);
+	r->c->replica = NULL;
+	r->c = NULL;
+	if (r->jobs){
+		return;
+	}
+	remove_sync_dir(r);
+	delete r;
+}
+
+// replica_release is called when a job that held on to r is done. Returns
+// false when the replica went away in the meantime, then it's freed here.
+static bool replica_release(replica *r){
+	r->jobs--;
+	if (r->c){
+		return true;
+	}
+	if (r->jobs == 0){
+		remove_sync_dir(r);
+		delete r;
+	}
+	return false;
+}
+
+// close_replicas drops every replica. They reconnect and sync again.
+static void close_replicas(){
+	std::vector<replica*> rs = replicas;
+	for (size_t i=0;i<rs.size();i++){
+		delete_iterators(rs[i]);
+		client_close(rs[i]->c);
+	}
+}
+
+// repl_reset is called before the database is closed.
+void repl_reset(){
+	close_replicas();
+}
+
+// repl_resync makes all replicas do a full sync. It's for changes that aren't
+// in the WAL, like ingested files.
+void repl_resync(){
+	// the sequence numbers don't move, a new history does it.
+	new_id();
+	close_replicas();
+}
+
+// can_continue returns true when the WAL of shard i still has everything
+// from seq on, and the value log still has what those batches point to.
+static bool can_continue(int i, uint64_t seq){
+	uint64_t latest = latest_seq(i);
+	if (seq > latest+1 || seq <= vlog_gone_seq(i)){
+		return false;
+	}
+	if (seq == latest+1){
+		return true;
+	}
+	std::unique_ptr<rocksdb::TransactionLogIterator> it;
+	rocksdb::Status s = shards[i].db->GetUpdatesSince(seq, &it);
+	// GetBatch moves the batch out, feed opens its own iterator.
+	return s.ok() && it->Valid() && it->GetBatch().sequence <= seq;
+}
+
+// list_files adds the files under path to files, the files in the shard
+// directories as <shard dir>/<file>.
+static void list_files(const std::string &path, const std::string &prefix,
+		std::vector<std::string> *files
+){
+	DIR *d = opendir(path.c_str());
+	if (!d){
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(d))){
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")){
+			continue;
+		}
+		std::string name = ent->d_name;
+		struct stat st;
+		if (!stat((path+"/"+name).c_str(), &st) && S_ISDIR(st.st_mode)){
+			list_files(path+"/"+name, prefix+name+"/", files);
+		}else{
+			files->push_back(prefix+name);
+		}
+	}
+	closedir(d);
+}
+
+static void on_sync_saved(const char *path, const char *err, void *udata){
+	replica *r = (replica*)udata;
+	if (!replica_release(r)){
+		if (!err){
+			remove_directory(path, 1);
+		}
+		return;
+	}
+	client *c = r->c;
+	if (err){
+		client_write_error(c, "full sync failed, could not create a checkpoint");
+		client_unblock(c);
+		return;
+	}
+	r->sync_dir = path;
+	std::vector<std::string> files;
+	list_files(path, "", &files);
+	client_write_multibulk(c, files.size()+2);
+	client_write_bulk(c, "FULLSYNC", 8);
+	client_write_bulk(c, replid, 40);
+	for (size_t i=0;i<files.size();i++){
+		client_write_bulk(c, files[i].data(), files[i].size());
+	}
+	log('*', "Replica %s full sync, sending %zu files", r->addr, files.size());
+	client_unblock(c);
+}
+
+error exec_psync(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'psync' command";
+	}
+	std::vector<uint64_t> seqs;
+	const char *p = c->args[2];
+	const char *end = c->args[2]+c->args_size[2];
+	for (;;){
+		const char *comma = (const char*)memchr(p, ',', end-p);
+		int64_t n;
+		if (!atoi64(p, (comma ? comma : end)-p, &n) || n < 0){
+			return "invalid offset";
+		}
+		seqs.push_back(n);
+		if (!comma){
+			break;
+		}
+		p = comma+1;
+	}
+	if ((int)seqs.size() != nshards){
+		client_err_alloc(c, 64);
+		sprintf(c->tmp_err, "the primary has %d shards", nshards);
+		return c->tmp_err;
+	}
+	if (inmem){
+		return "replication is not supported with --inmem";
+	}
+	replica *r = c->replica;
+	if (r){
+		// the replica is done with the full sync.
+		remove_sync_dir(r);
+		delete_iterators(r);
+	}else{
+		r = new replica();
+		r->c = c;
+		r->it.resize(nshards);
+		c->replica = r;
+		replicas.push_back(r);
+		struct sockaddr_storage addr;
+		socklen_t len = sizeof(addr);
+		strcpy(r->addr, "?");
+		if (!getpeername(client_fd(c), (struct sockaddr*)&addr, &len) &&
+			addr.ss_family == AF_INET){
+			struct sockaddr_in *in = (struct sockaddr_in*)&addr;
+			uv_ip4_name(in, r->addr, 32);
+			sprintf(r->addr+strlen(r->addr), ":%d", ntohs(in->sin_port));
+		}
+	}
+	r->online = false;
+	r->ack_seq = 0;
+	r->ack_time = uv_now(loop);
+	bool cont = c->args_size[1] == 40 && !memcmp(c->args[1], replid, 40);
+	uint64_t offset = 0;
+	for (int i=0;cont && i<nshards;i++){
+		cont = can_continue(i, seqs[i]);
+		offset += seqs[i]-1;
+	}
+	if (cont){
+		r->online = true;
+		r->next_seq = seqs;
+		r->ack_seq = offset;
+		client_write_multibulk(c, 1);
+		client_write_bulk(c, "CONTINUE", 8);
+		log('*', "Replica %s streaming from offset %llu", r->addr,
+			(unsigned long long)offset);
+		return NULL;
+	}
+	if (mkdir(savedir, 0755) && errno != EEXIST){
+		return "could not create the save directory";
+	}
+	// the checkpoint is at least this far, the value log keeps what the
+	// batches from here on point to until the replica continues.
+	r->next_seq.clear();
+	for (int i=0;i<nshards;i++){
+		r->next_seq.push_back(latest_seq(i)+1);
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/replsync-%lld", savedir, (long long)now_ms());
+	error e = save_background(path, on_sync_saved, r);
+	if (e){
+		return e;
+	}
+	r->jobs++;
+	client_block(c);
+	return NULL;
+}
+
+// REPLFILE reads a chunk of a checkpoint file on the thread pool.
+typedef struct replfile_job_t {
+	uv_work_t req;
+	replica *r;
+	std::string path;
+	uint64_t offset;
+	std::string chunk;
+	ssize_t n;
+} replfile_job;
+
+static void on_replfile_work(uv_work_t *req){
+	replfile_job *job = (replfile_job*)req->data;
+	int fd = open(job->path.c_str(), O_RDONLY);
+	if (fd < 0){
+		job->n = -2;
+		return;
+	}
+	job->chunk.resize(REPL_CHUNK_SIZE);
+	job->n = pread(fd, &job->chunk[0], job->chunk.size(), job->offset);
+	close(fd);
+}
+
+static void on_replfile_work_done(uv_work_t *req, int){
+	replfile_job *job = (replfile_job*)req->data;
+	if (replica_release(job->r)){
+		client *c = job->r->c;
+		if (job->n == -2){
+			client_write_error(c, "invalid file");
+		}else if (job->n < 0){
+			client_write_error(c, "could not read the file");
+		}else{
+			client_write_multibulk(c, 2);
+			client_write_bulk(c, "FILE", 4);
+			client_write_bulk(c, job->chunk.data(), job->n);
+		}
+		client_unblock(c);
+	}
+	delete job;
+}
+
+error exec_replfile(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'replfile' command";
+	}
+	uint64_t offset;
+	if (!c->replica || c->replica->sync_dir.empty()){
+		return "no full sync in progress";
+	}
+	std::string path;
+	if (!parse_seq(c, 2, &offset) || !subpath(c->replica->sync_dir.c_str(),
+		c->args[1], c->args_size[1], &path)){
+		return "invalid file";
+	}
+	replfile_job *job = new replfile_job();
+	job->req.data = job;
+	job->r = c->replica;
+	job->path = path;
+	job->offset = offset;
+	job->r->jobs++;
+	client_block(c);
+	uv_queue_work(loop, &job->req, on_replfile_work, on_replfile_work_done);
+	return NULL;
+}
+
+error exec_replack(client *c){
+	if (c->args_len!=2){
+		return "wrong number of arguments for 'replack' command";
+	}
+	if (!c->replica){
+		return "not a replica";
+	}
+	if (!parse_seq(c, 1, &c->replica->ack_seq)){
+		return "invalid offset";
+	}
+	c->replica->ack_time = uv_now(loop);
+	return NULL;
+}
+
+// repl_oldest_seq returns the oldest sequence of shard i that a replica is
+// still to be sent, or 0 when there's no replica.
+uint64_t repl_oldest_seq(int i){
+	uint64_t oldest = 0;
+	for (size_t j=0;j<replicas.size();j++){
+		replica *r = replicas[j];
+		if ((int)r->next_seq.size() > i && (!oldest || r->next_seq[i] < oldest)){
+			oldest = r->next_seq[i];
+		}
+	}
+	return oldest;
+}
+
+// feed sends the batches of shard i that the replica doesn't have yet.
+static void feed(replica *r, int i){
+	client *c = r->c;
+	uint64_t latest = latest_seq(i);
+	rocksdb::TransactionLogIterator *&it = r->it[i];
+	uint64_t &next_seq = r->next_seq[i];
+	bool reopened = false;
+	while (next_seq <= latest && c->output_len < REPL_OUTPUT_LIMIT){
+		if (it && !it->Valid()){
+			// tail the current WAL file first.
+			it->Next();
+		}
+		if (!it || !it->Valid()){
+			delete it;
+			it = NULL;
+			if (reopened){
+				return;
+			}
+			std::unique_ptr<rocksdb::TransactionLogIterator> nit;
+			rocksdb::Status s = shards[i].db->GetUpdatesSince(next_seq, &nit);
+			if (!s.ok()){
+				log('#', "Replica %s needs a full sync: %s", r->addr,
+					s.ToString().c_str());
+				client_close(c);
+				return;
+			}
+			it = nit.release();
+			reopened = true;
+			continue;
+		}
+		rocksdb::BatchResult b = it->GetBatch();
+		uint64_t count = b.writeBatchPtr->Count();
+		if (b.sequence+count <= next_seq){
+			it->Next();
+			continue;
+		}
+		if (b.sequence != next_seq){
+			log('#', "Replica %s needs a full sync: WAL gap at %llu",
+				r->addr, (unsigned long long)next_seq);
+			client_close(c);
+			return;
+		}
+		rocksdb::WriteBatch inlined;
+		if (vlog_in_use()){
+			// replicas get the values, not pointers into our value log.
+			if (!vlog_inline(b.writeBatchPtr.get(), &inlined)){
+				log('#', "Replica %s needs a full sync: value log entry "
+					"at %llu is gone", r->addr,
+					(unsigned long long)b.sequence);
+				// so that PSYNC from here answers FULLSYNC.
+				vlog_mark_gone(i, b.sequence+count);
+				client_close(c);
+				return;
+			}
+			b.writeBatchPtr.reset(new rocksdb::WriteBatch(inlined.Data()));
+		}
+		const std::string &rep = b.writeBatchPtr->Data();
+		client_write_multibulk(c, 4);
+		client_write_bulk(c, "BATCH", 5);
+		write_seq(c, i);
+		write_seq(c, b.sequence);
+		client_write_bulk(c, rep.data(), rep.size());
+		next_seq = b.sequence+count;
+		it->Next();
+	}
+}
+
+static void on_repl_check(uv_check_t *){
+	for (size_t i=0;i<replicas.size();i++){
+		replica *r = replicas[i];
+		if (!r->online){
+			continue;
+		}
+		for (int j=0;j<nshards && r->c->replica;j++){
+			feed(r, j);
+		}
+		if (r->c->replica){
+			client_flush(r->c);
+		}
+	}
+}
+
+// --- replica side ---
+
+static void link_write(std::vector<std::string> args){
+	client_write_multibulk(primary_link, args.size());
+	for (size_t i=0;i<args.size();i++){
+		client_write_bulk(primary_link, args[i].data(), args[i].size());
+	}
+	client_flush(primary_link);
+}
+
+static void send_psync(){
+	std::string seqs;
+	for (int i=0;i<nshards;i++){
+		char seq[32];
+		sprintf(seq, "%s%llu", i ? "," : "", (unsigned long long)latest_seq(i)+1);
+		seqs += seq;
+	}
+	link_write({"PSYNC", replid, seqs});
+	link_state = LINK_SYNC;
+}
+
+static void on_link_connect(uv_connect_t *req, int status){
+	client *c = (client*)req->handle;
+	delete req;
+	if (c != primary_link){
+		// unlinked while connecting.
+		return;
+	}
+	if (status < 0 || client_start(c)){
+		log('#', "Error connecting to the primary %s:%d: %s", primary_host,
+			primary_port, uv_strerror(status));
+		client_close(c);
+		return;
+	}
+	log('*', "Connected to the primary %s:%d", primary_host, primary_port);
+	link_io = uv_now(loop);
+	send_psync();
+}
+
+static void on_link_resolved(uv_getaddrinfo_t *resolver, int status,
+		struct addrinfo *res
+){
+	if (resolver != link_resolver){
+		// unlinked while resolving.
+		uv_freeaddrinfo(res);
+		delete resolver;
+		return;
+	}
+	link_resolver = NULL;
+	delete resolver;
+	if (status < 0){
+		log('#', "Could not resolve the primary %s: %s", primary_host,
+			uv_strerror(status));
+		link_state = LINK_NONE;
+		return;
+	}
+	primary_link = client_new();
+	primary_link->primary = 1;
+	uv_tcp_init(loop, &primary_link->tcp);
+	uv_connect_t *req = new uv_connect_t();
+	int r = uv_tcp_connect(req, &primary_link->tcp, res->ai_addr,
+		on_link_connect);
+	uv_freeaddrinfo(res);
+	if (r){
+		delete req;
+		client_close(primary_link);
+	}
+}
+
+// link_connect resolves the primary on the thread pool and connects to it.
+static void link_connect(){
+	char port[16];
+	sprintf(port, "%d", primary_port);
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	uv_getaddrinfo_t *resolver = new uv_getaddrinfo_t();
+	link_state = LINK_CONNECTING;
+	link_resolver = resolver;
+	int r = uv_getaddrinfo(loop, resolver, on_link_resolved, primary_host,
+		port, &hints);
+	if (r){
+		log('#', "Could not resolve the primary %s: %s", primary_host,
+			uv_strerror(r));
+		link_resolver = NULL;
+		link_state = LINK_NONE;
+		delete resolver;
+	}
+}
+
+static void sync_abort(){
+	if (sync_fp){
+		fclose(sync_fp);
+		sync_fp = NULL;
+	}
+	if (sync_dir.size()){
+		remove_directory(sync_dir.c_str(), 1);
+	}
+	sync_files.clear();
+	sync_idx = 0;
+}
+
+static void unlink_primary(){
+	// a resolve in flight finds out that it's not wanted anymore.
+	link_resolver = NULL;
+	if (primary_link){
+		client_close(primary_link);
+	}
+	sync_abort();
+	link_state = LINK_NONE;
+}
+
+// repl_close is called when a replica or the link to the primary closes.
+void repl_close(client *c){
+	if (c->replica){
+		log('*', "Replica %s disconnected", c->replica->addr);
+		replica_free(c->replica);
+	}
+	if (c == primary_link){
+		if (link_state != LINK_CONNECTING){
+			log('#', "Connection with the primary lost");
+		}
+		primary_link = NULL;
+		sync_abort();
+		link_state = LINK_NONE;
+	}
+}
+
+// load replaces the database with the checkpoint from the primary.
+static void load(){
+	if (save_in_progress() || vlog_busy() || dbsize_in_progress() ||
+		scan_in_progress() || compact_in_progress() || warmup_in_progress()){
+		// a background job is using the database, the timer tries again.
+		link_state = LINK_LOADING;
+		return;
+	}
+	close_replicas();
+	touch_all_keys();
+	closedb();
+	if (remove_directory(dir, false)){
+		err(1, "remove_directory");
+	}
+	// the shard directories move as a whole.
+	DIR *d = opendir(sync_dir.c_str());
+	if (!d){
+		err(1, "%s", sync_dir.c_str());
+	}
+	struct dirent *ent;
+	while ((ent = readdir(d))){
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")){
+			continue;
+		}
+		std::string from = sync_dir+"/"+ent->d_name;
+		std::string to = std::string(dir)+"/"+ent->d_name;
+		if (rename(from.c_str(), to.c_str())){
+			err(1, "%s", to.c_str());
+		}
+	}
+	closedir(d);
+	sync_abort();
+	strcpy(replid, sync_replid.c_str());
+	write_id();
+	opendb();
+	log('*', "Full sync from the primary done, %llu bytes, offset %llu",
+		(unsigned long long)sync_bytes, (unsigned long long)latest_offset());
+	send_psync();
+}
+
+static void request_file(){
+	if (sync_idx == sync_files.size()){
+		load();
+		return;
+	}
+	if (!sync_fp){
+		const std::string &name = sync_files[sync_idx];
+		std::string path = sync_dir+"/"+name;
+		for (size_t slash = name.find('/'); slash != std::string::npos;
+			slash = name.find('/', slash+1)
+		){
+			std::string sub = sync_dir+"/"+name.substr(0, slash);
+			if (mkdir(sub.c_str(), 0755) && errno != EEXIST){
+				err(1, "%s", sub.c_str());
+			}
+		}
+		sync_fp = fopen(path.c_str(), "wb");
+		if (!sync_fp){
+			err(1, "%s", path.c_str());
+		}
+		sync_offset = 0;
+	}
+	char offset[32];
+	sprintf(offset, "%llu", (unsigned long long)sync_offset);
+	link_write({"REPLFILE", sync_files[sync_idx], offset});
+}
+
+static error link_continue(client *){
+	link_state = LINK_ONLINE;
+	log('*', "Streaming from the primary at offset %llu",
+		(unsigned long long)latest_offset());
+	return NULL;
+}
+
+static error link_fullsync(client *c){
+	if (c->args_len<3 || c->args_size[1]!=40){
+		return "invalid FULLSYNC";
+	}
+	sync_abort();
+	sync_replid.assign(c->args[1], 40);
+	sync_dir = dir;
+	while (sync_dir.size() > 1 && sync_dir[sync_dir.size()-1] == '/'){
+		sync_dir.resize(sync_dir.size()-1);
+	}
+	sync_dir += ".sync";
+	for (int i=2;i<c->args_len;i++){
+		// the files are only ever written inside of the sync directory.
+		std::string path;
+		if (!subpath(sync_dir.c_str(), c->args[i], c->args_size[i], &path)){
+			sync_files.clear();
+			return "invalid file name in FULLSYNC";
+		}
+		sync_files.push_back(std::string(c->args[i], c->args_size[i]));
+	}
+	remove_directory(sync_dir.c_str(), 1);
+	if (mkdir(sync_dir.c_str(), 0755)){
+		err(1, "%s", sync_dir.c_str());
+	}
+	sync_idx = 0;
+	sync_bytes = 0;
+	link_state = LINK_TRANSFER;
+	log('*', "Full sync from the primary, receiving %zu files",
+		sync_files.size());
+	request_file();
+	return NULL;
+}
+
+static error link_file(client *c){
+	if (c->args_len!=2 || !sync_fp){
+		return "unexpected FILE";
+	}
+	if (c->args_size[1] == 0){
+		if (fclose(sync_fp)){
+			err(1, "fclose");
+		}
+		sync_fp = NULL;
+		sync_idx++;
+	}else{
+		if (fwrite(c->args[1], 1, c->args_size[1], sync_fp) !=
+			(size_t)c->args_size[1]){
+			err(1, "fwrite");
+		}
+		sync_offset += c->args_size[1];
+		sync_bytes += c->args_size[1];
+	}
+	request_file();
+	return NULL;
+}
+
+static error link_batch(client *c){
+	uint64_t shard, seq;
+	if (c->args_len!=4 || link_state != LINK_ONLINE ||
+		!parse_seq(c, 1, &shard) || !parse_seq(c, 2, &seq)){
+		return "unexpected BATCH";
+	}
+	if (shard >= (uint64_t)nshards){
+		return "BATCH for an unknown shard";
+	}
+	if (seq != latest_seq(shard)+1){
+		return "BATCH out of order";
+	}
+	rocksdb::WriteBatch batch(std::string(c->args[3], c->args_size[3]));
+	db_write_shard(shard, &batch);
+	return NULL;
+}
+
+static error link_ping(client *c){
+	if (c->args_len!=2 || !parse_seq(c, 1, &link_primary_seq)){
+		return "invalid PING";
+	}
+	char seq[32];
+	sprintf(seq, "%llu", (unsigned long long)latest_offset());
+	link_write({"REPLACK", seq});
+	return NULL;
+}
+
+static const command link_commands[] = {
+	{"continue", link_continue, 0},
+	{"fullsync", link_fullsync, 0},
+	{"file", link_file, 0},
+	{"batch", link_batch, CMD_WRITE},
+	{"ping", link_ping, 0},
+	{NULL, NULL, 0},
+};
+
+// repl_lookup_command looks up the messages from the primary.
+const command *repl_lookup_command(client *c){
+	link_io = uv_now(loop);
+	if (c->args_len==0){
+		return NULL;
+	}
+	if (c->args_size[0] && c->args[0][0] == '-'){
+		std::string msg;
+		for (int i=0;i<c->args_len;i++){
+			msg += (i ? " " : "")+std::string(c->args[i], c->args_size[i]);
+		}
+		log('#', "Primary replied: %s", msg.c_str());
+		return NULL;
+	}
+	for (const command *cmd=link_commands;cmd->name;cmd++){
+		if (islstr(c, 0, cmd->name)){
+			return cmd;
+		}
+	}
+	return NULL;
+}
+
+bool repl_readonly(client *c){
+	return primary_host && !c->primary;
+}
+
+static void on_repl_timer(uv_timer_t *){
+	if (shutting_down){
+		return;
+	}
+	uint64_t now = uv_now(loop);
+	for (size_t i=0;i<replicas.size();i++){
+		replica *r = replicas[i];
+		if (!r->online){
+			continue;
+		}
+		if (now-r->ack_time > REPL_TIMEOUT_MS){
+			log('#', "Replica %s timed out", r->addr);
+			client_close(r->c);
+			continue;
+		}
+		client *c = r->c;
+		client_write_multibulk(c, 2);
+		client_write_bulk(c, "PING", 4);
+		write_seq(c, latest_offset());
+		client_flush(c);
+	}
+	if (!primary_host){
+		return;
+	}
+	if (link_state == LINK_LOADING){
+		load();
+	}else if (!primary_link && !link_resolver){
+		link_connect();
+	}else if (link_state != LINK_CONNECTING && !primary_link->stalled &&
+		now-link_io > REPL_TIMEOUT_MS){
+		log('#', "Primary timed out");
+		client_close(primary_link);
+	}
+}
+
+void repl_init(){
+	uv_timer_init(loop, &repl_timer);
+	uv_timer_start(&repl_timer, on_repl_timer, 1000, 1000);
+	uv_check_init(loop, &repl_check);
+	uv_check_start(&repl_check, on_repl_check);
+	if (primary_host){
+		link_connect();
+	}
+}
+
+error exec_replicaof(client *c){
+	if (c->args_len!=3){
+		return "wrong number of arguments for 'replicaof' command";
+	}
+	if (islstr(c, 1, "no") && islstr(c, 2, "one")){
+		if (primary_host){
+			unlink_primary();
+			free((char*)primary_host);
+			primary_host = NULL;
+			// the data may go its own way from here.
+			new_id();
+			log('*', "Replication stopped, accepting writes");
+		}
+		client_write(c, "+OK\r\n", 5);
+		return NULL;
+	}
+	if (inmem){
+		return "replication is not supported with --inmem";
+	}
+	int port = atop(c->args[2], c->args_size[2]);
+	if (port <= 0 || port > 65535){
+		return "invalid port";
+	}
+	unlink_primary();
+	close_replicas();
+	free((char*)primary_host);
+	primary_host = strndup(c->args[1], c->args_size[1]);
+	primary_port = port;
+	log('*', "Replicating from %s:%d", primary_host, primary_port);
+	link_connect();
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+void repl_info(std::string *out){
+	char buf[512];
+	uint64_t latest = latest_offset();
+	uint64_t now = uv_now(loop);
+	if (!primary_host){
+		snprintf(buf, sizeof(buf),
+			"# Replication\r\n"
+			"role:primary\r\n"
+			"replid:%s\r\n"
+			"repl_offset:%llu\r\n"
+			"connected_replicas:%zu\r\n",
+			replid, (unsigned long long)latest, replicas.size());
+		out->append(buf);
+		for (size_t i=0;i<replicas.size();i++){
+			replica *r = replicas[i];
+			snprintf(buf, sizeof(buf),
+				"replica%zu:addr=%s,state=%s,offset=%llu,lag=%llu,"
+				"last_ack_ms=%llu\r\n",
+				i, r->addr, r->online ? "online" : "sync",
+				(unsigned long long)r->ack_seq,
+				(unsigned long long)(r->online ? latest-r->ack_seq : 0),
+				(unsigned long long)(now-r->ack_time));
+			out->append(buf);
+		}
+		return;
+	}
+	static const char *states[] = {
+		"down", "connecting", "sync", "transfer", "loading", "up",
+	};
+	uint64_t lag = 0;
+	if (link_state == LINK_ONLINE && link_primary_seq > latest){
+		lag = link_primary_seq-latest;
+	}
+	snprintf(buf, sizeof(buf),
+		"# Replication\r\n"
+		"role:replica\r\n"
+		"replid:%s\r\n"
+		"repl_offset:%llu\r\n"
+		"primary_host:%s\r\n"
+		"primary_port:%d\r\n"
+		"primary_link_status:%s\r\n"
+		"primary_last_io_ms:%llu\r\n"
+		"primary_repl_offset:%llu\r\n"
+		"repl_lag:%llu\r\n"
+		"sync_in_progress:%d\r\n"
+		"sync_files:%zu/%zu\r\n"
+		"sync_bytes:%llu\r\n"
+		"connected_replicas:%zu\r\n",
+		replid, (unsigned long long)latest,
+		primary_host, primary_port, states[link_state],
+		(unsigned long long)(primary_link ? now-link_io : 0),
+		(unsigned long long)link_primary_seq,
+		(unsigned long long)lag,
+		link_state == LINK_TRANSFER || link_state == LINK_LOADING,
+		sync_idx, sync_files.size(),
+		(unsigned long long)sync_bytes,
+		replicas.size());
+	out->append(buf);
+}
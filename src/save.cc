@@ -0,0 +1,213 @@
+#include "server.h"
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <rocksdb/utilities/checkpoint.h>
+
+// Saves are RocksDB checkpoints: live SST files are hard linked into the
+// target directory when it's on the same filesystem, everything else is
+// copied. The result is a directory that opens as a regular database. Value
+// log segments are hard linked next to it.
+const char *savedir = "snapshots";
+
+typedef struct save_job_t {
+	uv_work_t req;
+	std::string path;
+	rocksdb::Status status;
+	uint64_t start;
+	void (*done)(const char *path, const char *err, void *udata);
+	void *udata;
+} save_job;
+
+static save_job *save_current = NULL;
+static time_t lastsave = 0;
+static std::string lastsave_path;
+static const char *lastsave_status = "ok";
+static uint64_t lastsave_duration_ms = 0;
+static uint64_t saves = 0;
+
+bool save_in_progress(){
+	return save_current != NULL;
+}
+
+// checkpoint saves every shard, in the same layout as the data directory.
+// Each shard is consistent on its own, but not with the others.
+static rocksdb::Status checkpoint(const std::string &path){
+	if (nshards > 1 && mkdir(path.c_str(), 0755)){
+		return rocksdb::Status::IOError(path, strerror(errno));
+	}
+	for (int i=0;i<nshards;i++){
+		rocksdb::Checkpoint *cp;
+		rocksdb::Status s = rocksdb::Checkpoint::Create(shards[i].db, &cp);
+		if (!s.ok()){
+			return s;
+		}
+		s = cp->CreateCheckpoint(shard_path(path.c_str(), i));
+		delete cp;
+		if (s.ok()){
+			s = vlog_link(i, shard_path(path.c_str(), i));
+		}
+		if (!s.ok()){
+			return s;
+		}
+	}
+	if (!write_shards(path.c_str())){
+		return rocksdb::Status::IOError(path, "could not write SHARDS");
+	}
+	return rocksdb::Status::OK();
+}
+
+// save_path returns the directory for a new save, always under savedir. The
+// default is a timestamped directory.
+static error save_path(client *c, std::string *path){
+	if (inmem){
+		return "saving is not supported with --inmem";
+	}
+	if (mkdir(savedir, 0755) && errno != EEXIST){
+		return "could not create the save directory";
+	}
+	if (c && c->args_len==2){
+		if (!subpath(savedir, c->args[1], c->args_size[1], path)){
+			return "the save path must be relative to the save directory";
+		}
+		return NULL;
+	}
+	char name[64];
+	sprintf(name, "/checkpoint-%lld", (long long)now_ms());
+	path->assign(savedir);
+	path->append(name);
+	return NULL;
+}
+
+static void save_finished(const std::string &path, const rocksdb::Status &s,
+		uint64_t start
+){
+	lastsave_duration_ms = uv_now(loop)-start;
+	if (s.ok()){
+		lastsave = time(NULL);
+		lastsave_path = path;
+		lastsave_status = "ok";
+		saves++;
+		log('*', "DB saved on disk at %s", path.c_str());
+	}else{
+		lastsave_status = "err";
+		log('#', "Save to %s failed: %s", path.c_str(), s.ToString().c_str());
+	}
+}
+
+static void on_save_work(uv_work_t *req){
+	save_job *job = (save_job*)req->data;
+	job->status = checkpoint(job->path);
+}
+
+static void on_save_work_done(uv_work_t *req, int){
+	save_job *job = (save_job*)req->data;
+	save_current = NULL;
+	if (!job->done){
+		save_finished(job->path, job->status, job->start);
+	}else{
+		std::string err = job->status.ToString();
+		job->done(job->path.c_str(), job->status.ok() ? NULL : err.c_str(),
+			job->udata);
+	}
+	delete job;
+}
+
+// save_background creates a checkpoint at path on the thread pool. Without
+// done it's a regular save, with done it's a checkpoint for someone else,
+// like a replica, and done is called on the event loop when it's finished.
+error save_background(const std::string &path,
+		void (*done)(const char *path, const char *err, void *udata),
+		void *udata
+){
+	if (save_current){
+		return "Background save already in progress";
+	}
+	save_job *job = new save_job();
+	job->req.data = job;
+	job->path = path;
+	job->start = uv_now(loop);
+	job->done = done;
+	job->udata = udata;
+	save_current = job;
+	log('*', "Background saving started to %s", path.c_str());
+	uv_queue_work(loop, &job->req, on_save_work, on_save_work_done);
+	return NULL;
+}
+
+error exec_bgsave(client *c){
+	if (c->args_len>2){
+		return "wrong number of arguments for 'bgsave' command";
+	}
+	std::string path;
+	error e = save_path(c, &path);
+	if (e){
+		return e;
+	}
+	e = save_background(path, NULL, NULL);
+	if (e){
+		return e;
+	}
+	client_write(c, "+Background saving started\r\n", 28);
+	return NULL;
+}
+
+error exec_save(client *c){
+	if (c->args_len>2){
+		return "wrong number of arguments for 'save' command";
+	}
+	if (save_current){
+		return "Background save already in progress";
+	}
+	std::string path;
+	error e = save_path(c, &path);
+	if (e){
+		return e;
+	}
+	uint64_t start = uv_now(loop);
+	rocksdb::Status s = checkpoint(path);
+	uv_update_time(loop);
+	save_finished(path, s, start);
+	if (!s.ok()){
+		client_err_alloc(c, s.ToString().size()+64);
+		sprintf(c->tmp_err, "save failed: %s", s.ToString().c_str());
+		return c->tmp_err;
+	}
+	client_write(c, "+OK\r\n", 5);
+	return NULL;
+}
+
+error exec_lastsave(client *c){
+	if (c->args_len!=1){
+		return "wrong number of arguments for 'lastsave' command";
+	}
+	client_write_int(c, lastsave);
+	return NULL;
+}
+
+void save_info(std::string *out){
+	char buf[1024];
+	long long elapsed = -1;
+	if (save_current){
+		elapsed = (long long)(uv_now(loop)-save_current->start);
+	}
+	snprintf(buf, sizeof(buf),
+		"# Persistence\r\n"
+		"bgsave_in_progress:%d\r\n"
+		"bgsave_current_path:%s\r\n"
+		"bgsave_current_time_ms:%lld\r\n"
+		"last_save_time:%lld\r\n"
+		"last_save_path:%s\r\n"
+		"last_save_status:%s\r\n"
+		"last_save_duration_ms:%llu\r\n"
+		"saves:%llu\r\n",
+		save_current ? 1 : 0,
+		save_current ? save_current->path.c_str() : "",
+		elapsed,
+		(long long)lastsave,
+		lastsave_path.c_str(),
+		lastsave_status,
+		(unsigned long long)lastsave_duration_ms,
+		(unsigned long long)saves);
+	out->append(buf);
+}
@@ -0,0 +1,190 @@
+#include "server.h"
+#include <algorithm>
+#include <thread>
+
+// With --scan-threads n, KEYS splits the key range of the pattern into up to
+// n parts of about the same size at SST file boundaries and matches them on
+// n threads. The parts are read from a snapshot taken when the command arrives,
+// so the reply is the same as a single iterator would give, and it's sent
+// when all parts are done. Inside of EXEC, and when the keys don't span
+// enough files to split, KEYS runs on the event loop as usual.
+int scan_threads = 1;
+
+typedef struct scan_part_t {
+	std::string lo;
+	std::string hi;	// empty for the end of the keys
+	std::vector<std::string> keys;
+	rocksdb::Status status;
+} scan_part;
+
+typedef struct scan_job_t {
+	uv_work_t req;
+	client *c;
+	std::string pat;
+	std::vector<const rocksdb::Snapshot*> snaps;
+	std::vector<scan_part> parts;
+} scan_job;
+
+static int scanning = 0;
+
+bool scan_in_progress(){
+	return scanning > 0;
+}
+
+// split_keys returns up to n-1 keys in (lo, hi) that cut it into parts of
+// about the same size. The candidates are the first and last keys of the SST
+// files, weighed with GetApproximateSizes.
+static std::vector<std::string> split_keys(const std::string &lo,
+		const std::string &hi, int n
+){
+	std::vector<std::string> bounds;
+	for (int i=0;i<nshards;i++){
+		std::vector<rocksdb::LiveFileMetaData> files;
+		shards[i].db->GetLiveFilesMetaData(&files);
+		for (size_t j=0;j<files.size();j++){
+			if (files[j].column_family_name != rocksdb::kDefaultColumnFamilyName){
+				continue;
+			}
+			const std::string *keys[2] = {&files[j].smallestkey,
+				&files[j].largestkey};
+			for (int k=0;k<2;k++){
+				if (*keys[k] > lo && (hi.empty() || *keys[k] < hi)){
+					bounds.push_back(*keys[k]);
+				}
+			}
+		}
+	}
+	std::sort(bounds.begin(), bounds.end());
+	bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+	std::vector<std::string> splits;
+	if (bounds.size() < 2){
+		return splits;
+	}
+	// the size from lo up to each bound.
+	std::vector<rocksdb::Range> ranges;
+	for (size_t i=0;i<bounds.size();i++){
+		ranges.push_back(rocksdb::Range(lo, bounds[i]));
+	}
+	std::vector<uint64_t> sizes(bounds.size()), total(bounds.size());
+	for (int i=0;i<nshards;i++){
+		shards[i].db->GetApproximateSizes(ranges.data(), ranges.size(),
+			sizes.data());
+		for (size_t j=0;j<sizes.size();j++){
+			total[j] += sizes[j];
+		}
+	}
+	size_t j = 0;
+	for (int i=1;i<n;i++){
+		uint64_t target = total.back()/n*i;
+		while (j < bounds.size()-1 && total[j] < target){
+			j++;
+		}
+		if (total[j] == 0 || (splits.size() && splits.back() == bounds[j])){
+			continue;
+		}
+		splits.push_back(bounds[j]);
+	}
+	return splits;
+}
+
+static void scan_part_run(scan_job *job, scan_part *part){
+	int64_t now = now_ms();
+	rocksdb::ReadOptions options;
+	options.fill_cache = false;
+	rocksdb::Iterator *it = db_snapshot_iterator(NULL, options, job->snaps);
+	for (it->Seek(part->lo);it->Valid();it->Next()){
+		rocksdb::Slice key = it->key();
+		if (part->hi.size() && key.compare(part->hi) >= 0){
+			break;
+		}
+		if (!stringmatchlen(job->pat.data(), job->pat.size(),
+			key.data(), key.size(), 1)){
+			continue;
+		}
+		record r;
+		rocksdb::Slice value = it->value();
+		record_decode(value.data(), value.size(), &r);
+		if (!record_expired(&r, now)){
+			part->keys.push_back(key.ToString());
+		}
+	}
+	part->status = it->status();
+	delete it;
+}
+
+static void on_scan_work(uv_work_t *req){
+	scan_job *job = (scan_job*)req->data;
+	std::vector<std::thread> threads;
+	for (size_t i=1;i<job->parts.size();i++){
+		threads.push_back(std::thread(scan_part_run, job, &job->parts[i]));
+	}
+	scan_part_run(job, &job->parts[0]);
+	for (size_t i=0;i<threads.size();i++){
+		threads[i].join();
+	}
+}
+
+static void on_scan_work_done(uv_work_t *req, int){
+	scan_job *job = (scan_job*)req->data;
+	client *c = job->c;
+	scanning--;
+	db_release(&job->snaps);
+	size_t total = 0;
+	for (size_t i=0;i<job->parts.size();i++){
+		if (!job->parts[i].status.ok()){
+			err(1, "%s", job->parts[i].status.ToString().c_str());
+		}
+		total += job->parts[i].keys.size();
+	}
+	client_write_multibulk(c, total);
+	for (size_t i=0;i<job->parts.size();i++){
+		std::vector<std::string> &keys = job->parts[i].keys;
+		for (size_t j=0;j<keys.size();j++){
+			client_write_bulk(c, keys[j].data(), keys[j].size());
+		}
+	}
+	delete job;
+	client_unblock(c);
+}
+
+// keys_parallel replies to KEYS pat from the thread pool. Returns false when
+// the range can't be split and the caller should scan it itself.
+bool keys_parallel(client *c, const char *pat, int pat_len){
+	if (scan_threads <= 1 || db_in_transaction()){
+		return false;
+	}
+	char *start = NULL;
+	char *end = NULL;
+	int start_len = 0;
+	int end_len = 0;
+	int star = pattern_limits(pat, pat_len, &start, &start_len, &end, &end_len);
+	std::string lo, hi;
+	if (!star){
+		lo.assign(start, start_len);
+		hi.assign(end, end_len);
+	}
+	if (start){
+		free(start);
+	}
+	if (end){
+		free(end);
+	}
+	std::vector<std::string> splits = split_keys(lo, hi, scan_threads);
+	if (splits.empty()){
+		return false;
+	}
+	scan_job *job = new scan_job();
+	job->req.data = job;
+	job->c = c;
+	job->pat.assign(pat, pat_len);
+	job->parts.resize(splits.size()+1);
+	for (size_t i=0;i<job->parts.size();i++){
+		job->parts[i].lo = i == 0 ? lo : splits[i-1];
+		job->parts[i].hi = i == splits.size() ? hi : splits[i];
+	}
+	db_snapshot(&job->snaps);
+	scanning++;
+	client_block(c);
+	uv_queue_work(loop, &job->req, on_scan_work, on_scan_work_done);
+	return true;
+}
@@ -0,0 +1,82 @@
+#include "server.h"
+#include <deque>
+
+// Fair scheduling between clients. A client runs at most --turn-commands
+// commands, or for --turn-usec microseconds, each time its input is
+// processed. When there's more in its buffer it's paused and queued, and an
+// idle handle resumes the queued clients one turn at a time, while the loop
+// keeps polling the sockets of everyone else in between. A client that sends
+// slow commands, like KEYS or big SCAN pages, uses up its time after a few
+// of them, so clients that send point reads get their turn sooner. Either
+// limit is off when set to 0.
+int turn_commands = 1000;
+int turn_usec = 1000;
+
+static std::deque<client*> ready;
+static uv_idle_t sched_idle;
+static uint64_t turns_yielded = 0;
+
+// sched_turn_over returns true when a client that has run n commands since
+// start has used up its turn.
+bool sched_turn_over(client *c, int n, uint64_t start){
+	if (c->primary){
+		// the replication stream isn't held back.
+		return false;
+	}
+	if (turn_commands > 0 && n >= turn_commands){
+		return true;
+	}
+	return turn_usec > 0 && uv_hrtime()-start >= (uint64_t)turn_usec*1000;
+}
+
+static void on_sched_idle(uv_idle_t *){
+	// only the clients queued so far, a client that yields again waits for
+	// the next loop iteration.
+	size_t n = ready.size();
+	for (size_t i=0;i<n && ready.size();i++){
+		client *c = ready.front();
+		ready.pop_front();
+		c->yielded = 0;
+		client_resume(c);
+	}
+	if (ready.empty()){
+		uv_idle_stop(&sched_idle);
+	}
+}
+
+// sched_yield pauses a client at the end of its turn and queues it to go on
+// with the rest of its buffer.
+void sched_yield(client *c){
+	turns_yielded++;
+	c->yielded = 1;
+	client_pause(c);
+	ready.push_back(c);
+	uv_idle_start(&sched_idle, on_sched_idle);
+}
+
+void sched_remove(client *c){
+	for (size_t i=0;i<ready.size();i++){
+		if (ready[i] == c){
+			ready.erase(ready.begin()+i);
+			break;
+		}
+	}
+	c->yielded = 0;
+}
+
+void sched_init(){
+	uv_idle_init(loop, &sched_idle);
+}
+
+void sched_info(std::string *out){
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+		"# Scheduler\r\n"
+		"turn_commands:%d\r\n"
+		"turn_usec:%d\r\n"
+		"yielded_clients:%zu\r\n"
+		"turns_yielded:%llu\r\n",
+		turn_commands, turn_usec, ready.size(),
+		(unsigned long long)turns_yielded);
+	out->append(buf);
+}
@@ -1,19 +1,38 @@
 #include "server.h"
+#include <sys/stat.h>
 
-rocksdb::DB* db = NULL;
+std::vector<shard> shards;
+int nshards = 1;
 bool nosync = true;
 int nprocs = 1;
 uv_loop_t *loop = NULL;
 bool inmem = false;
+bool checked_merge = false;
 const char *dir = "data";
+int tcp_port = 5555;
+const char *unixsocket = NULL;
+static int unixsocketperm = 0;
+time_t start_time = 0;
 
 const char *ERR_INCOMPLETE = "incomplete";
 const char *ERR_QUIT = "quit";
+const char *ERR_WRONGTYPE =
+	"WRONGTYPE Operation against a key holding the wrong kind of value";
 
 void get_buffer(uv_handle_t *handle, size_t size, uv_buf_t *buf){
 	client *c = (client*)handle;
-	if (c->buf_cap-c->buf_idx-c->buf_len < size){
-		while (c->buf_cap-c->buf_idx-c->buf_len < size){
+	int need = (int)size;
+	if (c->buf_cap-c->buf_idx-c->buf_len < need && c->buf_idx &&
+		c->buf_cap-c->buf_len >= need && !c->blocked
+	){
+		// the consumed commands make enough room. not while blocked, the
+		// running command may still use its arguments.
+		memmove(c->buf, c->buf+c->buf_idx, c->buf_len);
+		c->buf_idx = 0;
+	}
+	if (c->buf_cap-c->buf_idx-c->buf_len < need){
+		int cap = c->buf_cap;
+		while (c->buf_cap-c->buf_idx-c->buf_len < need){
 			if (c->buf_cap==0){
 				c->buf_cap=1;
 			}else{
@@ -24,31 +43,117 @@ void get_buffer(uv_handle_t *handle, size_t size, uv_buf_t *buf){
 		if (!c->buf){
 			err(1, "malloc");
 		}
+		client_memory += c->buf_cap-cap;
 	}
 	buf->base = c->buf+c->buf_idx+c->buf_len;
 	buf->len = size;
 }
 
-void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf){
+// client_process executes the commands in the read buffer and writes out the
+// replies.
+static void client_process(client *c){
+	client_clear(c);
+	bool keep_alive = client_exec_commands(c);
+	client_flush_offset(c, c->output_offset);
+	if (c->throttled && !c->writing){
+		// the write failed, no completion will resume the client.
+		keep_alive = false;
+	}
+	if (!keep_alive){
+		client_close(c);
+		return;
+	}
+	client_trim(c);
+}
+
+void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *){
 	client *c = (client*)stream;
 	if (nread < 0) {
 		client_close(c);
 		return;
 	}
 	c->buf_len += nread;
-	client_clear(c);
-	bool keep_alive = client_exec_commands(c);
-	client_flush_offset(c, c->output_offset);
-	if (!keep_alive){
+	client_process(c);
+}
+
+// client_read adds data that the io_uring backend read to the buffer and,
+// unless the client is paused, executes it.
+void client_read(client *c, const char *data, int n, bool process){
+	uv_buf_t buf;
+	get_buffer(&c->handle, n, &buf);
+	memcpy(buf.base, data, n);
+	c->buf_len += n;
+	if (process){
+		client_process(c);
+	}
+}
+
+// client_pause stops reading from the client. The commands that are already
+// buffered stay in the buffer until client_resume.
+void client_pause(client *c){
+	if (c->uring){
+		uring_pause(c);
+		return;
+	}
+	uv_read_stop(&c->stream);
+}
+
+// client_start begins reading commands from the client.
+int client_start(client *c){
+	if (c->uring){
+		return uring_start(c);
+	}
+	return uv_read_start(&c->stream, get_buffer, on_read);
+}
+
+// client_fd returns the socket of the client.
+int client_fd(client *c){
+	if (c->uring){
+		return uring_fd(c);
+	}
+	uv_os_fd_t fd;
+	if (uv_fileno(&c->handle, &fd)){
+		return -1;
+	}
+	return fd;
+}
+
+void client_resume(client *c){
+	if (shutting_down){
+		// the server doesn't read commands anymore.
+		return;
+	}
+	if (client_start(c)){
 		client_close(c);
+		return;
 	}
+	client_process(c);
+}
+
+// client_block pauses the client while its command finishes on the thread
+// pool. The reading is stopped, so the client can't go away in the meantime.
+void client_block(client *c){
+	c->blocked = 1;
+	client_pause(c);
+}
+
+// client_unblock sends the reply written by the finished command and goes on
+// with the commands that were buffered behind it.
+void client_unblock(client *c){
+	c->blocked = 0;
+	client_flush(c);
+	client_resume(c);
 }
 
 void on_accept_work(uv_work_t *worker) {
 	client *c = (client*)worker->data;
-	uv_tcp_init(loop, &c->tcp);
-	if (uv_accept(c->server, (uv_stream_t *)&c->tcp) == 0) {
-		if (uv_read_start((uv_stream_t *)&c->tcp, get_buffer, on_read)){
+	if (c->server->type == UV_NAMED_PIPE){
+		uv_pipe_init(loop, &c->pipe, 0);
+	}else{
+		uv_tcp_init(loop, &c->tcp);
+	}
+	if (uv_accept(c->server, &c->stream) == 0) {
+		if (client_start(c)){
 			c->must_close = 1;
 		}
 		// read has started
@@ -57,7 +162,7 @@ void on_accept_work(uv_work_t *worker) {
 	}
 }
 
-void on_accept_work_done(uv_work_t *worker, int status) {
+void on_accept_work_done(uv_work_t *worker, int) {
 	client *c = (client*)worker->data;
 	if (c->must_close){
 		client_close(c);
@@ -95,7 +200,7 @@ void log(char c, const char *format, ...){
 	char cc[32];
 	if (isatty(1)){
 		switch (c) {
-		default: cc[0] = c; cc[1] = 0; 
+		default: cc[0] = c; cc[1] = 0; break;
 		case '.': strcpy(cc, "\x1b[35m.\x1b[0m"); break;
 		case '*': strcpy(cc, "\x1b[1m*\x1b[0m"); break;
 		case '#': strcpy(cc, "\x1b[33m#\x1b[0m"); break;
@@ -107,35 +212,154 @@ void log(char c, const char *format, ...){
 	va_end(args);
 }
 
-void opendb(){
+// check_shards makes sure that the database is opened with the number of
+// shards that it was created with, the shard of a key depends on it.
+static void check_shards(){
+	if (inmem){
+		return;
+	}
+	if (mkdir(dir, 0755) && errno != EEXIST){
+		err(1, "%s", dir);
+	}
+	std::string path = std::string(dir)+"/SHARDS";
+	FILE *f = fopen(path.c_str(), "r");
+	if (f){
+		int n = 0;
+		if (fscanf(f, "%d", &n) != 1){
+			n = 0;
+		}
+		fclose(f);
+		if (n != nshards){
+			errx(1, "%s was created with --shards %d", dir, n);
+		}
+		return;
+	}
+	if (nshards > 1 && access((std::string(dir)+"/CURRENT").c_str(), F_OK) == 0){
+		errx(1, "%s was created with --shards 1", dir);
+	}
+	if (!write_shards(dir)){
+		err(1, "%s", path.c_str());
+	}
+}
+
+static void open_shard(shard *sh, const std::string &path){
 	rocksdb::Options options;
 	options.create_if_missing = true;
+	options.create_missing_column_families = true;
+	options.merge_operator.reset(merge_operator_new());
+	options.compaction_filter = ttl_filter_get();
+	stall_options(&options);
+	memory_options(&options);
+	repl_options(&options);
+	compact_options(&options);
 	if (inmem){
 		options.env = rocksdb::NewMemEnv(rocksdb::Env::Default());
 	}
-	rocksdb::Status s = rocksdb::DB::Open(options, dir, &db);
+	rocksdb::ColumnFamilyOptions hopts(options);
+	hash_options(&hopts);
+	std::vector<rocksdb::ColumnFamilyDescriptor> cfs;
+	cfs.push_back(rocksdb::ColumnFamilyDescriptor(
+		rocksdb::kDefaultColumnFamilyName, options));
+	cfs.push_back(rocksdb::ColumnFamilyDescriptor("hash", hopts));
+	std::vector<rocksdb::ColumnFamilyHandle*> handles;
+	rocksdb::Status s = rocksdb::DB::Open(options, path, cfs, &handles, &sh->db);
 	if (!s.ok()){
 		err(1, "%s", s.ToString().c_str());
 	}
+	delete handles[0];
+	sh->hashcf = handles[1];
+}
+
+void opendb(){
+	check_shards();
+	shards.resize(nshards);
+	for (int i=0;i<nshards;i++){
+		open_shard(&shards[i], shard_path(dir, i));
+		vlog_open(i, shard_path(dir, i));
+	}
+	hashcf = shards[0].hashcf;
+	repl_open();
+}
+
+void closedb(){
+	cursor_reset();
+	for (int i=0;i<nshards;i++){
+		delete shards[i].hashcf;
+		delete shards[i].db;
+	}
+	shards.clear();
+	hashcf = NULL;
+	vlog_close();
+	dbsize_reset();
 }
 
 void flushdb(){
-	delete db;
+	repl_reset();
+	touch_all_keys();
+	closedb();
 	if (remove_directory(dir, false)){
 		err(1, "remove_directory");
 	}
 	opendb();
 }
 
+// listen_stream starts accepting connections on a bound socket, through
+// io_uring when it's in use.
+static std::vector<uv_handle_t*> listeners;
+
+static int listen_stream(uv_stream_t *server){
+	listeners.push_back((uv_handle_t *)server);
+	if (!use_uring){
+		return uv_listen(server, -1, on_accept);
+	}
+	uv_os_fd_t fd;
+	int r = uv_fileno((uv_handle_t *)server, &fd);
+	if (r){
+		return r;
+	}
+	if (listen(fd, SOMAXCONN)){
+		return -errno;
+	}
+	uring_listen(fd);
+	return 0;
+}
+
+// stop_listening closes the listening sockets.
+void stop_listening(){
+	if (use_uring){
+		uring_unlisten();
+	}
+	for (size_t i=0;i<listeners.size();i++){
+		uv_close(listeners[i], NULL);
+	}
+	listeners.clear();
+}
+
+// listen_unix listens on the unix socket, replacing the socket file that a
+// previous run left behind.
+static void listen_unix(uv_pipe_t *server){
+	unlink(unixsocket);
+	uv_pipe_init(loop, server, 0);
+	int r = uv_pipe_bind(server, unixsocket);
+	if (r){
+		errx(1, "%s: %s", unixsocket, uv_strerror(r));
+	}
+	if (unixsocketperm && chmod(unixsocket, unixsocketperm)){
+		err(1, "%s", unixsocket);
+	}
+	r = listen_stream((uv_stream_t *)server);
+	if (r){
+		errx(1, "listen: %s", uv_strerror(r));
+	}
+}
+
 int main(int argc, char **argv) {
-	int tcp_port = 5555;
-	bool tcp_port_provided = false;
 	for (int i=1;i<argc;i++){
 		if (strcmp(argv[i], "-h")==0||
 			strcmp(argv[i], "--help")==0||
 			strcmp(argv[i], "-?")==0){
 			fprintf(stdout, "RocksDB version " ROCKSDB_VERSION ", Libuv version " LIBUV_VERSION ", Server version " SERVER_VERSION "\n");
-			fprintf(stdout, "usage: %s [-d data_path] [-p tcp_port] [--sync] [--inmem]\n", argv[0]);
+			fprintf(stdout, "usage: %s [-d data_path] [-p tcp_port] [--sync] [--inmem] [--checked-merge] [--savedir path] [--ingestdir path] [--replicaof host:port] [--shards n] [--unixsocket path] [--unixsocketperm mode] [--io libuv|uring] [--vlog-threshold bytes] [--scan-threads n] [--scan-cursors n] [--scan-cursor-ttl seconds] [--rate-limit bytes] [--rate-limit-auto] [--warmup-keys n] [--turn-commands n] [--turn-usec n] [--maxmemory bytes] [--client-output-limit bytes]\n", argv[0]);
 			return 0;
 		}else if (strcmp(argv[i], "--version")==0){
 			fprintf(stdout, "RocksDB version " ROCKSDB_VERSION ", Libuv version " LIBUV_VERSION ", Server version " SERVER_VERSION "\n");
@@ -150,6 +374,188 @@ int main(int argc, char **argv) {
 			nosync = false;
 		}else if (strcmp(argv[i], "--inmem")==0){
 			inmem = true;
+		}else if (strcmp(argv[i], "--checked-merge")==0){
+			checked_merge = true;
+		}else if (strcmp(argv[i], "--ingestdir")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			ingestdir = argv[++i];
+		}else if (strcmp(argv[i], "--savedir")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			savedir = argv[++i];
+		}else if (strcmp(argv[i], "--replicaof")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			const char *colon = strrchr(argv[i+1], ':');
+			if (!colon || atoi(colon+1) <= 0){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			primary_host = strndup(argv[i+1], colon-argv[i+1]);
+			primary_port = atoi(colon+1);
+			i++;
+		}else if (strcmp(argv[i], "--shards")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			nshards = atoi(argv[i+1]);
+			if (nshards <= 0 || nshards > 256){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--scan-threads")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			scan_threads = atoi(argv[i+1]);
+			if (scan_threads <= 0 || scan_threads > 256){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--rate-limit")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			if (!atoi64(argv[i+1], strlen(argv[i+1]), &rate_limit) ||
+				rate_limit < 0){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--maxmemory")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			if (!atoi64(argv[i+1], strlen(argv[i+1]), &maxmemory) ||
+				maxmemory < 0){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--client-output-limit")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			if (!atoi64(argv[i+1], strlen(argv[i+1]), &client_output_limit) ||
+				client_output_limit < 0){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--rate-limit-auto")==0){
+			rate_limit_auto = true;
+		}else if (strcmp(argv[i], "--warmup-keys")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			warmup_keys = atoi(argv[i+1]);
+			if (warmup_keys < 0 || (warmup_keys == 0 && strcmp(argv[i+1], "0"))){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--turn-commands")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			turn_commands = atoi(argv[i+1]);
+			if (turn_commands < 0 || (turn_commands == 0 && strcmp(argv[i+1], "0"))){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--turn-usec")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			turn_usec = atoi(argv[i+1]);
+			if (turn_usec < 0 || (turn_usec == 0 && strcmp(argv[i+1], "0"))){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--scan-cursors")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			scan_cursors = atoi(argv[i+1]);
+			if (scan_cursors < 0 || (scan_cursors == 0 && strcmp(argv[i+1], "0"))){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--scan-cursor-ttl")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			scan_cursor_ttl = atoi(argv[i+1]);
+			if (scan_cursor_ttl <= 0){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--unixsocket")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			unixsocket = argv[++i];
+		}else if (strcmp(argv[i], "--unixsocketperm")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			char *end;
+			unixsocketperm = strtol(argv[i+1], &end, 8);
+			if (*end || unixsocketperm <= 0 || unixsocketperm > 0777){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--vlog-threshold")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			if (!atoi64(argv[i+1], strlen(argv[i+1]), &vlog_threshold) ||
+				vlog_threshold < 0){
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
+		}else if (strcmp(argv[i], "--io")==0){
+			if (i+1 == argc){
+				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
+				return 1;
+			}
+			if (strcmp(argv[i+1], "uring")==0){
+				use_uring = true;
+			}else if (strcmp(argv[i+1], "libuv")==0){
+				use_uring = false;
+			}else{
+				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
+				return 1;
+			}
+			i++;
 		}else if (strcmp(argv[i], "-p")==0){
 			if (i+1 == argc){
 				fprintf(stderr, "argument missing after: \"%s\"\n", argv[i]);
@@ -160,17 +566,29 @@ int main(int argc, char **argv) {
 				fprintf(stderr, "invalid option '%s' for argument: \"%s\"\n", argv[i+1], argv[i]);
 			}
 			i++;
-			tcp_port_provided = true;
 		}else{
 			fprintf(stderr, "unknown option argument: \"%s\"\n", argv[i]);
 			return 1;
 		}
 	}
 	log('#', "Server started, RocksDB version " ROCKSDB_VERSION ", Libuv version " LIBUV_VERSION ", Server version " SERVER_VERSION);
+	start_time = time(NULL);
+	loop = uv_default_loop();
+	if (use_uring && !uring_init()){
+		log('#', "io_uring is not available, falling back to libuv");
+		use_uring = false;
+	}
+	stall_init();
+	sched_init();
 	opendb();
+	repl_init();
+	vlog_init();
+	cursor_init();
+	compact_init();
+	warmup_init();
+	shutdown_init();
 
 	uv_tcp_t server;
-	loop = uv_default_loop();
 
 	struct sockaddr_in addr;
 	uv_ip4_addr("0.0.0.0", tcp_port, &addr);
@@ -178,10 +596,16 @@ int main(int argc, char **argv) {
 	uv_tcp_init(loop, &server);
 	uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
 
-	int r = uv_listen((uv_stream_t *)&server, -1, on_accept);
+	int r = listen_stream((uv_stream_t *)&server);
 	if (r) {
 		err(1, "uv_listen");
 	}
 	log('*', "The server is now ready to accept connections on port %d", tcp_port);
+
+	uv_pipe_t unix_server;
+	if (unixsocket){
+		listen_unix(&unix_server);
+		log('*', "The server is now ready to accept connections at %s", unixsocket);
+	}
 	return uv_run(loop, UV_RUN_DEFAULT);
 }
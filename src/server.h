@@ -7,14 +7,42 @@
 #include <uv.h>
 #include <rocksdb/db.h>
 #include <rocksdb/options.h>
+#include <rocksdb/table.h>
+#include <rocksdb/merge_operator.h>
+#include <rocksdb/compaction_filter.h>
+#include <rocksdb/utilities/write_batch_with_index.h>
+#include <vector>
+#include <string>
 
-extern rocksdb::DB* db;
+// shard is one of the RocksDB instances that keys are partitioned across.
+typedef struct shard_t {
+	rocksdb::DB *db;
+	rocksdb::ColumnFamilyHandle *hashcf;
+} shard;
+
+extern std::vector<shard> shards;
+extern int nshards;
+// hashcf names the hash column family in the db_* functions and in write
+// batches, each shard has its own handle.
+extern rocksdb::ColumnFamilyHandle *hashcf;
 extern bool nosync;
+extern bool inmem;
+extern bool checked_merge;
 extern int nprocs;
 extern uv_loop_t *loop;
+extern const char *dir;
+extern int tcp_port;
+extern const char *unixsocket;
+extern bool use_uring;
+extern time_t start_time;
+extern int nclients;
+extern struct client_t *clients;
+extern const char *savedir;
+extern const char *ingestdir;
 
 extern const char *ERR_INCOMPLETE;
 extern const char *ERR_QUIT;
+extern const char *ERR_WRONGTYPE;
 
 void log(char c, const char *format, ...);
 
@@ -22,16 +50,63 @@ int stringmatchlen(const char *pattern, int patternLen,
         const char *string, int stringLen, int nocase);
 int pattern_limits(const char *pattern, int patternLen, 
 		char **start, int *startLen, char **end, int *endLen);
+void opendb();
+void closedb();
 void flushdb();
 int remove_directory(const char *path, int remove_parent);
 
+// shard_of_key returns the shard for key.
+int shard_of_key(const char *key, int len, int n);
+std::string shard_path(const char *base, int i);
+bool write_shards(const char *base);
+
 // atoul returns a positive integer. invalid or negative integers return -1.
 int atop(const char* str, int len);
 
+// atoi64 parses a signed 64-bit integer. returns false on invalid input or
+// overflow.
+bool atoi64(const char *str, int len, int64_t *n);
+
+// subpath joins base and a relative path given by a client, returns false
+// when the path isn't below base.
+bool subpath(const char *base, const char *path, int len, std::string *out);
+
+extern const char MERGE_INCR;
+extern const char MERGE_APPEND;
+rocksdb::MergeOperator *merge_operator_new();
+bool merge_apply(std::string *value, const rocksdb::Slice &op);
+
+// record is a decoded stored value. expires is a unix timestamp in
+// milliseconds, or zero when the value never expires. When vlog is set, data
+// is a pointer into the value log rather than the value, see vlog_resolve.
+// When hash is set, the key is a hash and the record carries no value.
+typedef struct record_t {
+	int64_t expires;
+	const char *data;
+	int len;
+	int vlog;
+	int hash;
+} record;
+
+int64_t now_ms();
+void record_encode(std::string *out, const char *data, int len, int64_t expires);
+void record_encode_hash(std::string *out, int64_t expires);
+void record_decode(const char *data, int len, record *r);
+void record_reencode(std::string *out, const record *r, int64_t expires);
+bool record_expired(const record *r, int64_t now);
+const rocksdb::CompactionFilter *ttl_filter_get();
+
 typedef const char *error;
 
 typedef struct client_t {
-	uv_tcp_t tcp;	// should always be the first element.
+	// should always be the first element. tcp or pipe depending on the
+	// listener that accepted the client.
+	union {
+		uv_tcp_t tcp;
+		uv_pipe_t pipe;
+		uv_stream_t stream;
+		uv_handle_t handle;
+	};
 	uv_write_t req;
 	uv_work_t worker;
 	uv_stream_t *server;
@@ -49,27 +124,251 @@ typedef struct client_t {
 	int output_len;
 	int output_cap;
 	int output_offset;
+	int writing;	// end of the output being written, zero when idle
+	struct tx_t *tx;
+	int stalled;
+	int blocked;	// waiting for a command running on the thread pool
+	int yielded;	// paused at the end of its turn, see sched.cc
+	int throttled;	// paused until its write completes, see memory.cc
+	int overlimit;	// went over the output limit and is being closed
+	int primary;	// the link to the primary on a replica
+	struct replica_t *replica;
+	struct uring_conn_t *uring;	// io_uring backend state, NULL on libuv
+	struct client_t *next;	// in the list of all clients
+	struct client_t *prev;
 } client;
 
 client *client_new();
 void client_free(client *c);
 void client_close(client *c);
+void client_pause(client *c);
+void client_resume(client *c);
+int client_start(client *c);
+void client_block(client *c);
+void client_unblock(client *c);
+void client_read(client *c, const char *data, int n, bool process);
+void client_write_done(client *c, int status);
+int client_fd(client *c);
 
 void client_write(client *c, const char *data, int n);
 void client_clear(client *c);
 void client_write_byte(client *c, char b);
 void client_write_bulk(client *c, const char *data, int n);
 void client_write_multibulk(client *c, int n);
-void client_write_int(client *c, int n);
+void client_write_int(client *c, long long n);
 void client_write_error(client *c, error err);
 void client_flush_offset(client *c, int offset);
 void client_flush(client *c);
+void client_trim(client *c);
+void client_err_alloc(client *c, int n);
 error client_err_expected_got(client *c, char c1, char c2);
 error client_err_unknown_command(client *c, const char *name, int count);
+error client_err_inside_multi(client *c, const char *name, int count);
 
 bool client_exec_commands(client *c);
 
-error exec_command(client *c);
+// command flags
+const int CMD_NOMULTI = 1;	// not allowed between MULTI and EXEC
+const int CMD_NOQUEUE = 2;	// runs right away between MULTI and EXEC
+const int CMD_WRITE = 4;	// may write to the database
+
+typedef struct command_t {
+	const char *name;
+	error (*proc)(client *c);
+	int flags;
+} command;
+
+error exec_command(client *c, const command *cmd);
+const command *lookup_command(client *c);
+bool islstr(client *c, int arg_idx, const char *str);
+error parse_scan_options(client *c, int idx, 
+		const char **pat, int *pat_len, int *count);
+
+bool db_get(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key,
+		std::string *value);
+void db_put(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key,
+		const rocksdb::Slice &value);
+void db_delete(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key);
+void db_merge(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key,
+		const rocksdb::Slice &value);
+void db_multi_get(const std::vector<rocksdb::Slice> &keys,
+		std::vector<std::string> *values, std::vector<bool> *found);
+void db_write(rocksdb::WriteBatch *batch);
+void db_write_shard(int i, rocksdb::WriteBatch *batch);
+rocksdb::Iterator *db_iterator(rocksdb::ColumnFamilyHandle *cf,
+		rocksdb::ReadOptions &options);
+rocksdb::Iterator *db_key_iterator(rocksdb::ColumnFamilyHandle *cf,
+		const rocksdb::Slice &key, rocksdb::ReadOptions &options);
+rocksdb::Iterator *db_snapshot_iterator(rocksdb::ColumnFamilyHandle *cf,
+		rocksdb::ReadOptions &options,
+		const std::vector<const rocksdb::Snapshot*> &snaps);
+void db_snapshot(std::vector<const rocksdb::Snapshot*> *snaps);
+void db_release(std::vector<const rocksdb::Snapshot*> *snaps);
+uint64_t db_oldest_snapshot(int i);
+bool db_in_transaction();
+void db_prefetch(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key);
+void db_begin();
+void db_commit();
+
+bool multi_active(client *c);
+void multi_free(client *c);
+error multi_queue(client *c, const command *cmd);
+bool watching();
+void touch_key(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key);
+void touch_all_keys();
+error exec_multi(client *c);
+error exec_exec(client *c);
+error exec_discard(client *c);
+error exec_watch(client *c);
+error exec_unwatch(client *c);
+
+// write stall states
+const int STALL_NONE = 0;
+const int STALL_SLOWDOWN = 1;
+const int STALL_STOP = 2;
+
+extern int stall_state;
+void stall_init();
+void stall_options(rocksdb::Options *options);
+bool stall_admit(client *c, const command *cmd);
+void stall_remove(client *c);
+void stall_info(std::string *out);
+
+error exec_info(client *c);
+
+bool save_in_progress();
+error save_background(const std::string &path,
+		void (*done)(const char *path, const char *err, void *udata),
+		void *udata);
+error exec_save(client *c);
+error exec_bgsave(client *c);
+error exec_lastsave(client *c);
+void save_info(std::string *out);
+
+bool ingest_in_progress();
+error exec_ingest(client *c);
+
+bool dbsize_in_progress();
+void dbsize_reset();
+error exec_dbsize(client *c);
+error exec_rangesize(client *c);
+void dbsize_info(std::string *out);
+
+extern int64_t rate_limit;
+extern bool rate_limit_auto;
+void compact_options(rocksdb::Options *options);
+void compact_init();
+bool compact_in_progress();
+error exec_compact(client *c);
+void compact_info(std::string *out);
+
+extern int warmup_keys;
+bool warmup_in_progress();
+void warmup_touch(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key);
+void warmup_save();
+void warmup_init();
+
+// buffers of a client that are larger than this are freed when empty.
+const int CLIENT_BUF_KEEP = 64*1024;
+
+extern int64_t maxmemory;
+extern int64_t client_output_limit;
+extern int64_t client_memory;
+void memory_options(rocksdb::Options *options);
+void memory_table_options(rocksdb::BlockBasedTableOptions *table_options);
+bool memory_output_allowed(client *c, size_t size);
+bool memory_throttle(client *c);
+void memory_info(std::string *out);
+
+extern int turn_commands;
+extern int turn_usec;
+bool sched_turn_over(client *c, int n, uint64_t start);
+void sched_yield(client *c);
+void sched_remove(client *c);
+void sched_init();
+void sched_info(std::string *out);
+
+extern bool shutting_down;
+void shutdown_init();
+void stop_listening();
+
+// scan_cursor is a SCAN session, see cursor.cc.
+typedef struct scan_cursor_t {
+	uint32_t id;
+	std::string pat;
+	std::vector<const rocksdb::Snapshot*> snaps;
+	rocksdb::Iterator *it;
+	int64_t pos;	// matches before the iterator
+	bool fresh;	// the iterator wasn't positioned yet
+	uint64_t used;
+} scan_cursor;
+
+extern int scan_cursors;
+extern int scan_cursor_ttl;
+int64_t cursor_position(int64_t cursor);
+scan_cursor *cursor_get(int64_t cursor, const char *pat, int pat_len);
+int64_t cursor_next(scan_cursor *sc, int64_t pos);
+void cursor_close(scan_cursor *sc);
+void cursor_reset();
+void cursor_init();
+void cursor_info(std::string *out);
+
+extern int scan_threads;
+bool scan_in_progress();
+bool keys_parallel(client *c, const char *pat, int pat_len);
+
+extern char replid[41];
+extern const char *primary_host;
+extern int primary_port;
+void repl_options(rocksdb::Options *options);
+void repl_open();
+void repl_init();
+void repl_reset();
+void repl_resync();
+void repl_close(client *c);
+bool repl_readonly(client *c);
+const command *repl_lookup_command(client *c);
+error exec_psync(client *c);
+error exec_replfile(client *c);
+error exec_replack(client *c);
+error exec_replicaof(client *c);
+void repl_info(std::string *out);
+uint64_t repl_oldest_seq(int shard);
+
+extern int64_t vlog_threshold;
+void vlog_open(int shard, const std::string &shard_dir);
+void vlog_close();
+void vlog_init();
+bool vlog_in_use();
+bool vlog_busy();
+bool vlog_separate(int shard, const rocksdb::Slice &key,
+	const rocksdb::Slice &value, std::string *out);
+bool vlog_resolve(record *r, std::string *buf);
+int64_t vlog_length(const record *r);
+bool vlog_inline(rocksdb::WriteBatch *in, rocksdb::WriteBatch *out);
+rocksdb::Status vlog_link(int shard, const std::string &shard_dir);
+uint64_t vlog_gone_seq(int shard);
+void vlog_mark_gone(int shard, uint64_t seq);
+void vlog_info(std::string *out);
+
+bool uring_init();
+void uring_listen(int fd);
+void uring_unlisten();
+int uring_start(client *c);
+void uring_pause(client *c);
+void uring_write(client *c, const char *data, int n);
+void uring_close(client *c);
+int uring_fd(client *c);
+
+void hash_options(rocksdb::ColumnFamilyOptions *options);
+rocksdb::Slice hash_key_of(const rocksdb::Slice &fkey);
+int hash_delete(const char *key, int key_len);
+error exec_hset(client *c);
+error exec_hget(client *c);
+error exec_hmget(client *c);
+error exec_hdel(client *c);
+error exec_hgetall(client *c);
+error exec_hscan(client *c);
 
 
 #endif // SERVER_H
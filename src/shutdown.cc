@@ -0,0 +1,96 @@
+#include "server.h"
+#include <rocksdb/convenience.h>
+
+// On SIGTERM or SIGINT the server shuts down cleanly: it stops accepting
+// connections and reading commands, sends the replies that are already
+// queued, waits for the background jobs that read the database, saves the
+// keys for the cache warmup, and flushes the memtables before closing the
+// database, so that the next start has no WAL to replay. A COMPACT that's
+// still running is cancelled. Clients that don't take their replies within
+// SHUTDOWN_DRAIN_MS are dropped. A second signal exits right away.
+const uint64_t SHUTDOWN_DRAIN_MS = 5000;
+
+bool shutting_down = false;
+
+static uv_signal_t sigterm;
+static uv_signal_t sigint;
+static uv_timer_t shutdown_timer;
+static uint64_t shutdown_start = 0;
+static bool flushed = false;
+
+// drained returns true when no client has replies left to send.
+static bool drained(){
+	for (client *c=clients;c;c=c->next){
+		if (c->output_len || c->writing || c->blocked){
+			return false;
+		}
+	}
+	return true;
+}
+
+// jobs_running returns true while a background job reads the database.
+static bool jobs_running(){
+	return save_in_progress() || ingest_in_progress() ||
+		dbsize_in_progress() || scan_in_progress() || vlog_busy() ||
+		warmup_in_progress();
+}
+
+static void on_shutdown_timer(uv_timer_t *){
+	if (!drained() && uv_now(loop)-shutdown_start < SHUTDOWN_DRAIN_MS){
+		return;
+	}
+	if (jobs_running()){
+		return;
+	}
+	if (!flushed){
+		flushed = true;
+		warmup_save();
+		// RocksDB 4.13 only flushes on cancel when the WAL is off, so the
+		// memtables are flushed here, then the compactions are stopped.
+		for (int i=0;i<nshards;i++){
+			rocksdb::FlushOptions options;
+			rocksdb::Status s = shards[i].db->Flush(options);
+			if (s.ok()){
+				s = shards[i].db->Flush(options, shards[i].hashcf);
+			}
+			if (!s.ok()){
+				log('#', "Could not flush the memtables: %s", s.ToString().c_str());
+			}
+			rocksdb::CancelAllBackgroundWork(shards[i].db, true);
+		}
+	}
+	if (compact_in_progress()){
+		return;
+	}
+	closedb();
+	if (unixsocket){
+		unlink(unixsocket);
+	}
+	log('#', "RocksDB-Server is now ready to exit, bye bye...");
+	exit(0);
+}
+
+static void on_signal(uv_signal_t *, int signum){
+	if (shutting_down){
+		log('#', "Received %s again, exiting now", strsignal(signum));
+		exit(1);
+	}
+	shutting_down = true;
+	log('#', "Received %s, shutting down", strsignal(signum));
+	stop_listening();
+	for (client *c=clients;c;c=c->next){
+		if (!c->blocked){
+			client_pause(c);
+		}
+	}
+	shutdown_start = uv_now(loop);
+	uv_timer_init(loop, &shutdown_timer);
+	uv_timer_start(&shutdown_timer, on_shutdown_timer, 0, 50);
+}
+
+void shutdown_init(){
+	uv_signal_init(loop, &sigterm);
+	uv_signal_start(&sigterm, on_signal, SIGTERM);
+	uv_signal_init(loop, &sigint);
+	uv_signal_start(&sigint, on_signal, SIGINT);
+}
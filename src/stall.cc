@@ -0,0 +1,250 @@
+#include "server.h"
+#include <rocksdb/listener.h>
+#include <atomic>
+
+// Admission control for writes. RocksDB slows down or stops writes when
+// compaction falls behind, and a blocked Put would stall the event loop for
+// every client. Instead the stall conditions are polled here. While writes
+// would stop, clients that want to write are paused until the conditions
+// clear. While they would only be slowed down, writes are admitted up to
+// RocksDB's delayed_write_rate, the budget is refilled on every timer tick and
+// the clients that ran out of it are paused until then. Clients that only
+// read keep being served.
+int stall_state = STALL_NONE;
+static const char *stall_reason = "";
+static uv_timer_t stall_timer;
+static uv_async_t stall_async;
+static std::vector<client*> stalled_clients;
+static uint64_t stall_events = 0;
+static uint64_t stall_deferred = 0;
+static uint64_t stall_time_ms = 0;
+static uint64_t stall_started = 0;
+static uint64_t l0_files = 0;
+static uint64_t pending_compaction_bytes = 0;
+static uint64_t slowdown_rate = 0;	// bytes per second
+static int64_t slowdown_budget = 0;
+static std::atomic<bool> stall_changed(false);
+
+// stall_listener wakes up the event loop when a flush or compaction finishes,
+// which is when a stall condition might have cleared. A sealed memtable is
+// when one might begin, the next write checks the conditions again.
+class stall_listener : public rocksdb::EventListener {
+public:
+	virtual void OnMemTableSealed(const rocksdb::MemTableInfo &) override {
+		stall_changed = true;
+	}
+	virtual void OnFlushCompleted(rocksdb::DB *,
+			const rocksdb::FlushJobInfo &) override {
+		uv_async_send(&stall_async);
+	}
+	virtual void OnCompactionCompleted(rocksdb::DB *,
+			const rocksdb::CompactionJobInfo &) override {
+		uv_async_send(&stall_async);
+	}
+};
+
+static std::shared_ptr<rocksdb::EventListener> listener(new stall_listener());
+
+void stall_options(rocksdb::Options *options){
+	options->listeners.push_back(listener);
+}
+
+static uint64_t int_property(rocksdb::DB *db, rocksdb::ColumnFamilyHandle *cf,
+		const char *name
+){
+	std::string value;
+	if (!db->GetProperty(cf, name, &value)){
+		return 0;
+	}
+	return strtoull(value.c_str(), NULL, 10);
+}
+
+static int cf_state(rocksdb::DB *db, rocksdb::ColumnFamilyHandle *cf,
+		const char **reason
+){
+	rocksdb::Options options = db->GetOptions(cf);
+	uint64_t l0 = int_property(db, cf, "rocksdb.num-files-at-level0");
+	uint64_t pending = int_property(db, cf, "rocksdb.estimate-pending-compaction-bytes");
+	uint64_t imm = int_property(db, cf, "rocksdb.num-immutable-mem-table");
+	l0_files += l0;
+	pending_compaction_bytes += pending;
+	// same conditions that RocksDB uses in RecalculateWriteStallConditions.
+	if (imm >= (uint64_t)options.max_write_buffer_number){
+		*reason = "memtables";
+		return STALL_STOP;
+	}
+	if (l0 >= (uint64_t)options.level0_stop_writes_trigger){
+		*reason = "level0_files";
+		return STALL_STOP;
+	}
+	if (options.hard_pending_compaction_bytes_limit &&
+		pending >= options.hard_pending_compaction_bytes_limit){
+		*reason = "pending_compaction_bytes";
+		return STALL_STOP;
+	}
+	if (options.max_write_buffer_number > 3 &&
+		imm >= (uint64_t)options.max_write_buffer_number-1){
+		*reason = "memtables";
+		return STALL_SLOWDOWN;
+	}
+	if (l0 >= (uint64_t)options.level0_slowdown_writes_trigger){
+		*reason = "level0_files";
+		return STALL_SLOWDOWN;
+	}
+	if (options.soft_pending_compaction_bytes_limit &&
+		pending >= options.soft_pending_compaction_bytes_limit){
+		*reason = "pending_compaction_bytes";
+		return STALL_SLOWDOWN;
+	}
+	return STALL_NONE;
+}
+
+static void stall_update(bool resume){
+	if (shards.empty()){
+		return;
+	}
+	stall_changed = false;
+	l0_files = 0;
+	pending_compaction_bytes = 0;
+	const char *reason = "";
+	int state = STALL_NONE;
+	// a stalled shard pauses all writers, a client may write to any shard.
+	for (int i=0;i<nshards;i++){
+		rocksdb::ColumnFamilyHandle *cfs[] = {
+			shards[i].db->DefaultColumnFamily(), shards[i].hashcf,
+		};
+		for (int j=0;j<2;j++){
+			const char *r = "";
+			int st = cf_state(shards[i].db, cfs[j], &r);
+			if (st > state){
+				state = st;
+				reason = r;
+			}
+		}
+	}
+	uint64_t now = uv_now(loop);
+	if (state != STALL_NONE && stall_state == STALL_NONE){
+		stall_events++;
+		stall_started = now;
+	}else if (state == STALL_NONE && stall_state != STALL_NONE){
+		stall_time_ms += now-stall_started;
+		log('*', "Writes resumed after %llu ms",
+			(unsigned long long)(now-stall_started));
+	}
+	if (state == STALL_STOP && stall_state != STALL_STOP){
+		log('#', "Writes paused, RocksDB is stalling on %s", reason);
+	}else if (state == STALL_SLOWDOWN && stall_state != STALL_SLOWDOWN){
+		slowdown_rate = shards[0].db->GetDBOptions().delayed_write_rate;
+		slowdown_budget = slowdown_rate/10;
+		log('#', "Writes slowed down to %llu bytes/s, RocksDB is stalling on %s",
+			(unsigned long long)slowdown_rate, reason);
+	}
+	stall_state = state;
+	stall_reason = reason;
+	if (stall_state == STALL_STOP || !resume ||
+		(stall_state == STALL_SLOWDOWN && slowdown_budget <= 0)){
+		return;
+	}
+	std::vector<client*> clients;
+	clients.swap(stalled_clients);
+	for (size_t i=0;i<clients.size();i++){
+		clients[i]->stalled = 0;
+		client_resume(clients[i]);
+	}
+}
+
+static void on_stall_timer(uv_timer_t *){
+	if (stall_state == STALL_SLOWDOWN){
+		// a tenth of a second of writes.
+		slowdown_budget = slowdown_rate/10;
+	}
+	stall_update(true);
+}
+
+static void on_stall_async(uv_async_t *){
+	stall_update(true);
+}
+
+void stall_init(){
+	uv_timer_init(loop, &stall_timer);
+	uv_timer_start(&stall_timer, on_stall_timer, 100, 100);
+	uv_async_init(loop, &stall_async, on_stall_async);
+}
+
+// write_cost returns the bytes that a write adds, about.
+static int64_t write_cost(client *c){
+	int64_t n = 0;
+	for (int i=1;i<c->args_len;i++){
+		n += c->args_size[i];
+	}
+	return n;
+}
+
+// stall_admit returns false when cmd is a write that must wait for the stall
+// to clear or the slowdown budget to be refilled. The client is paused and
+// resumed later from the same command.
+bool stall_admit(client *c, const command *cmd){
+	if (!cmd || !(cmd->flags&CMD_WRITE)){
+		return true;
+	}
+	if (stall_changed){
+		// paused clients are only resumed from the timer and async
+		// callbacks, never from inside of another client's commands.
+		stall_update(false);
+	}
+	if (stall_state == STALL_NONE){
+		return true;
+	}
+	if (multi_active(c) && !(cmd->flags&CMD_NOQUEUE)){
+		// only queued, nothing is written until EXEC.
+		return true;
+	}
+	if (stall_state == STALL_SLOWDOWN && slowdown_budget > 0){
+		slowdown_budget -= write_cost(c);
+		return true;
+	}
+	stall_deferred++;
+	c->stalled = 1;
+	stalled_clients.push_back(c);
+	client_pause(c);
+	return false;
+}
+
+void stall_remove(client *c){
+	for (size_t i=0;i<stalled_clients.size();i++){
+		if (stalled_clients[i] == c){
+			stalled_clients.erase(stalled_clients.begin()+i);
+			break;
+		}
+	}
+	c->stalled = 0;
+}
+
+void stall_info(std::string *out){
+	static const char *states[] = {"none", "slowdown", "stop"};
+	uint64_t total = stall_time_ms;
+	if (stall_state != STALL_NONE){
+		total += uv_now(loop)-stall_started;
+	}
+	char buf[512];
+	snprintf(buf, sizeof(buf),
+		"# Stall\r\n"
+		"stall_state:%s\r\n"
+		"stall_reason:%s\r\n"
+		"stall_events:%llu\r\n"
+		"stall_time_ms:%llu\r\n"
+		"stalled_clients:%zu\r\n"
+		"slowdown_write_rate:%llu\r\n"
+		"deferred_writes:%llu\r\n"
+		"level0_files:%llu\r\n"
+		"pending_compaction_bytes:%llu\r\n",
+		states[stall_state], stall_reason,
+		(unsigned long long)stall_events,
+		(unsigned long long)total,
+		stalled_clients.size(),
+		(unsigned long long)(stall_state == STALL_SLOWDOWN ? slowdown_rate : 0),
+		(unsigned long long)stall_deferred,
+		(unsigned long long)l0_files,
+		(unsigned long long)pending_compaction_bytes);
+	out->append(buf);
+}
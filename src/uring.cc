@@ -0,0 +1,464 @@
+#include "server.h"
+
+// An io_uring backend for the client sockets, selected with --io uring. The
+// listeners use a multishot accept and every client a multishot recv that
+// picks its buffers from a ring of buffers registered with the kernel, so a
+// busy connection doesn't need a new request for every read. Requests are
+// queued while the event loop runs and submitted together right before it
+// polls, with a single io_uring_enter. Completions wake up the libuv loop
+// through an eventfd, so timers, the thread pool and the link to a primary
+// keep running on libuv.
+
+bool use_uring = false;
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifndef HAVE_IO_URING
+
+bool uring_init(){
+	return false;
+}
+void uring_listen(int){}
+void uring_unlisten(){}
+int uring_start(client *){ return -1; }
+void uring_pause(client *){}
+void uring_write(client *, const char *, int){}
+void uring_close(client *){}
+int uring_fd(client *){ return -1; }
+
+#else
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+
+const int URING_ENTRIES = 4096;
+const int URING_BUFS = 1024;		// power of two
+const int URING_BUF_SIZE = 16*1024;
+const int URING_BGID = 0;
+
+// the request kind is kept in the low bits of the user data, next to the
+// client or listener pointer.
+const uint64_t OP_ACCEPT = 0;
+const uint64_t OP_RECV = 1;
+const uint64_t OP_SEND = 2;
+const uint64_t OP_CANCEL = 3;
+const uint64_t OP_MASK = 3;
+
+typedef struct uring_conn_t {
+	int fd;
+	bool reading;		// started and not paused
+	bool recv_armed;	// the multishot recv is in flight
+	bool closing;
+	bool sending;		// a send is in flight
+	int pending;		// requests in flight
+	// the output buffer of the client may be reallocated while a send is in
+	// flight, so sends go out of a copy.
+	char *wbuf;
+	int wcap;
+	int wlen;
+	int woff;
+} uring_conn;
+
+typedef struct listener_t {
+	int fd;
+	bool closed;
+} listener;
+
+static std::vector<listener*> listeners;
+
+static int ring_fd = -1;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+static unsigned to_submit = 0;
+static struct io_uring_buf_ring *buf_ring;
+static char *bufs;
+static int event_fd;
+static uv_poll_t event_poll;
+static uv_prepare_t submit_prepare;
+static std::vector<client*> closing;
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags){
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+		NULL, 0);
+}
+
+static void submit(){
+	while (to_submit){
+		int n = sys_enter(to_submit, 0, 0);
+		if (n < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			if (errno == EAGAIN || errno == EBUSY){
+				// the completion queue is full, drain it first.
+				return;
+			}
+			err(1, "io_uring_enter");
+		}
+		to_submit -= n;
+	}
+}
+
+static struct io_uring_sqe *get_sqe(){
+	unsigned tail = *sq_tail;
+	if (tail-__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries){
+		submit();
+		if (tail-__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries){
+			errx(1, "io_uring submission queue is full");
+		}
+	}
+	unsigned idx = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail+1, __ATOMIC_RELEASE);
+	to_submit++;
+	return sqe;
+}
+
+static void add_buf(int bid){
+	unsigned short tail = buf_ring->tail;
+	// not buf_ring->bufs, the flexible array moves in C++.
+	struct io_uring_buf *b = (struct io_uring_buf*)buf_ring+(tail & (URING_BUFS-1));
+	b->addr = (uint64_t)(bufs+(size_t)bid*URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	__atomic_store_n(&buf_ring->tail, tail+1, __ATOMIC_RELEASE);
+}
+
+static uring_conn *conn(client *c){
+	return (uring_conn*)c->uring;
+}
+
+static void arm_accept(listener *l){
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (uint64_t)l | OP_ACCEPT;
+}
+
+static void arm_recv(client *c){
+	uring_conn *u = conn(c);
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = u->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (uint64_t)c | OP_RECV;
+	u->recv_armed = true;
+	u->pending++;
+}
+
+static void arm_send(client *c){
+	uring_conn *u = conn(c);
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = u->fd;
+	sqe->addr = (uint64_t)(u->wbuf+u->woff);
+	sqe->len = u->wlen-u->woff;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t)c | OP_SEND;
+	u->sending = true;
+	u->pending++;
+}
+
+static void on_accept_cqe(listener *l, struct io_uring_cqe *cqe){
+	if (l->closed){
+		if (cqe->res >= 0){
+			close(cqe->res);
+		}
+		return;
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE)){
+		arm_accept(l);
+	}
+	if (cqe->res < 0){
+		return;
+	}
+	client *c = client_new();
+	uring_conn *u = (uring_conn*)calloc(1, sizeof(uring_conn));
+	if (!u){
+		err(1, "malloc");
+	}
+	u->fd = cqe->res;
+	c->uring = u;
+	client_start(c);
+}
+
+static void on_recv_cqe(client *c, struct io_uring_cqe *cqe){
+	uring_conn *u = conn(c);
+	if (cqe->flags & IORING_CQE_F_BUFFER){
+		int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !u->closing){
+			client_read(c, bufs+(size_t)bid*URING_BUF_SIZE, cqe->res, u->reading);
+		}
+		add_buf(bid);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE){
+		return;
+	}
+	u->recv_armed = false;
+	u->pending--;
+	if (u->closing){
+		return;
+	}
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+		cqe->res != -ECANCELED)){
+		client_close(c);
+	}else if (u->reading){
+		// out of buffers, or paused and resumed before the cancel landed.
+		arm_recv(c);
+	}
+}
+
+static void on_send_cqe(client *c, struct io_uring_cqe *cqe){
+	uring_conn *u = conn(c);
+	u->pending--;
+	u->sending = false;
+	if (cqe->res > 0){
+		u->woff += cqe->res;
+		if (u->woff < u->wlen){
+			arm_send(c);
+			return;
+		}
+	}
+	if (u->closing){
+		// the last reply is out.
+		shutdown(u->fd, SHUT_RDWR);
+		return;
+	}
+	client_write_done(c, cqe->res < 0 ? cqe->res : 0);
+}
+
+static void reap(){
+	unsigned head = *cq_head;
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+		struct io_uring_cqe cqe = cqes[head & *cq_mask];
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		uint64_t op = cqe.user_data & OP_MASK;
+		void *p = (void*)(cqe.user_data & ~OP_MASK);
+		if (op == OP_ACCEPT){
+			on_accept_cqe((listener*)p, &cqe);
+		}else if (op == OP_RECV){
+			on_recv_cqe((client*)p, &cqe);
+		}else if (op == OP_SEND){
+			on_send_cqe((client*)p, &cqe);
+		}else{
+			conn((client*)p)->pending--;
+		}
+	}
+}
+
+static void on_event(uv_poll_t *, int, int){
+	uint64_t n;
+	if (read(event_fd, &n, sizeof(n)) < 0 && errno != EAGAIN){
+		err(1, "eventfd");
+	}
+	reap();
+}
+
+// on_submit_prepare submits everything queued during this loop iteration and
+// frees the clients that have nothing in flight anymore.
+static void on_submit_prepare(uv_prepare_t *){
+	reap();
+	for (size_t i=0;i<closing.size();){
+		client *c = closing[i];
+		uring_conn *u = conn(c);
+		if (u->pending){
+			i++;
+			continue;
+		}
+		close(u->fd);
+		free(u->wbuf);
+		free(u);
+		client_free(c);
+		closing[i] = closing.back();
+		closing.pop_back();
+	}
+	submit();
+}
+
+// supported checks that the kernel has everything that's used here. The
+// multishot recv came with Linux 6.0, together with IORING_OP_SEND_ZC,
+// which is what the probe can tell.
+static bool supported(){
+	size_t size = sizeof(struct io_uring_probe)+
+		IORING_OP_LAST*sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, size);
+	if (!probe){
+		err(1, "malloc");
+	}
+	bool ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+		probe, IORING_OP_LAST) == 0 &&
+		probe->last_op >= IORING_OP_SEND_ZC &&
+		(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+// uring_init sets up the ring. Returns false when io_uring is not available,
+// the caller falls back to libuv then.
+bool uring_init(){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring_fd < 0){
+		return false;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !supported()){
+		close(ring_fd);
+		return false;
+	}
+	size_t sq_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	size_t size = sq_size > cq_size ? sq_size : cq_size;
+	char *sq = (char*)mmap(NULL, size, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED){
+		err(1, "mmap");
+	}
+	sq_head = (unsigned*)(sq+p.sq_off.head);
+	sq_tail = (unsigned*)(sq+p.sq_off.tail);
+	sq_mask = (unsigned*)(sq+p.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq+p.sq_off.array);
+	sq_entries = p.sq_entries;
+	cq_head = (unsigned*)(sq+p.cq_off.head);
+	cq_tail = (unsigned*)(sq+p.cq_off.tail);
+	cq_mask = (unsigned*)(sq+p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(sq+p.cq_off.cqes);
+	sqes = (struct io_uring_sqe*)mmap(NULL,
+		p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED){
+		err(1, "mmap");
+	}
+
+	// the receive buffers.
+	buf_ring = (struct io_uring_buf_ring*)mmap(NULL,
+		URING_BUFS*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	bufs = (char*)malloc((size_t)URING_BUFS*URING_BUF_SIZE);
+	if (buf_ring == MAP_FAILED || !bufs){
+		err(1, "malloc");
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+		&reg, 1)){
+		err(1, "io_uring_register");
+	}
+	buf_ring->tail = 0;
+	for (int i=0;i<URING_BUFS;i++){
+		add_buf(i);
+	}
+
+	event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (event_fd < 0 || syscall(__NR_io_uring_register, ring_fd,
+		IORING_REGISTER_EVENTFD, &event_fd, 1)){
+		err(1, "eventfd");
+	}
+	uv_poll_init(loop, &event_poll, event_fd);
+	uv_poll_start(&event_poll, UV_READABLE, on_event);
+	uv_prepare_init(loop, &submit_prepare);
+	uv_prepare_start(&submit_prepare, on_submit_prepare);
+	return true;
+}
+
+// uring_listen accepts the connections of a listening socket.
+void uring_listen(int fd){
+	listener *l = new listener();
+	l->fd = fd;
+	l->closed = false;
+	listeners.push_back(l);
+	arm_accept(l);
+}
+
+// uring_unlisten stops accepting connections. Shutting the sockets down ends
+// the accepts in flight, the sockets are closed by their owners.
+void uring_unlisten(){
+	for (size_t i=0;i<listeners.size();i++){
+		listeners[i]->closed = true;
+		shutdown(listeners[i]->fd, SHUT_RDWR);
+	}
+}
+
+int uring_start(client *c){
+	uring_conn *u = conn(c);
+	u->reading = true;
+	if (!u->recv_armed && !u->closing){
+		arm_recv(c);
+	}
+	return 0;
+}
+
+// uring_pause stops the recv, data that still comes in is buffered for
+// uring_start.
+void uring_pause(client *c){
+	uring_conn *u = conn(c);
+	u->reading = false;
+	if (!u->recv_armed){
+		return;
+	}
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)c | OP_RECV;
+	sqe->user_data = (uint64_t)c | OP_CANCEL;
+	u->pending++;
+}
+
+void uring_write(client *c, const char *data, int n){
+	uring_conn *u = conn(c);
+	if (u->wcap < n){
+		u->wbuf = (char*)realloc(u->wbuf, n);
+		if (!u->wbuf){
+			err(1, "malloc");
+		}
+		u->wcap = n;
+	}
+	memcpy(u->wbuf, data, n);
+	u->wlen = n;
+	u->woff = 0;
+	arm_send(c);
+}
+
+// uring_close shuts the socket down, after the send in flight if there is
+// one, which ends the other requests in flight. The client is freed once
+// they're all done.
+void uring_close(client *c){
+	uring_conn *u = conn(c);
+	if (u->closing){
+		return;
+	}
+	u->closing = true;
+	u->reading = false;
+	if (!u->sending){
+		shutdown(u->fd, SHUT_RDWR);
+	}
+	closing.push_back(c);
+}
+
+int uring_fd(client *c){
+	return conn(c)->fd;
+}
+
+#endif
@@ -96,3 +96,101 @@ int atop(const char* str, int len){
     }
     return ret;
 }
+
+// atoi64 parses a signed 64-bit integer. returns false on invalid input or
+// overflow.
+bool atoi64(const char *str, int len, int64_t *n){
+	if (len <= 0 || len > 20){
+		return false;
+	}
+	int i = 0;
+	bool neg = false;
+	if (str[0] == '-'){
+		if (len == 1){
+			return false;
+		}
+		neg = true;
+		i++;
+	}
+	uint64_t ret = 0;
+	for (;i<len;i++){
+		if (str[i] < '0' || str[i] > '9'){
+			return false;
+		}
+		uint64_t next = ret * 10 + (str[i] - '0');
+		if (next / 10 != ret){
+			return false;
+		}
+		ret = next;
+	}
+	if (neg){
+		if (ret > (uint64_t)INT64_MAX+1){
+			return false;
+		}
+		*n = (int64_t)(0-ret);
+	}else{
+		if (ret > (uint64_t)INT64_MAX){
+			return false;
+		}
+		*n = (int64_t)ret;
+	}
+	return true;
+}
+
+// shard_of_key hashes key with 64-bit FNV-1a. The shard of a key is part of
+// the on-disk layout, so this must never change.
+int shard_of_key(const char *key, int len, int n){
+	if (n == 1){
+		return 0;
+	}
+	uint64_t h = 14695981039346656037ULL;
+	for (int i=0;i<len;i++){
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	return (int)(h%n);
+}
+
+// shard_path returns the directory of shard i under base. A single shard is
+// stored in base itself.
+std::string shard_path(const char *base, int i){
+	if (nshards == 1){
+		return base;
+	}
+	char name[32];
+	sprintf(name, "/shard-%03d", i);
+	return std::string(base)+name;
+}
+
+// write_shards records the number of shards in base.
+bool write_shards(const char *base){
+	std::string path = std::string(base)+"/SHARDS";
+	FILE *f = fopen(path.c_str(), "w");
+	if (!f){
+		return false;
+	}
+	bool ok = fprintf(f, "%d\n", nshards) >= 0;
+	return !fclose(f) && ok;
+}
+
+// subpath joins base and a path that a client gave. The path must be
+// relative and stay below base, returns false otherwise.
+bool subpath(const char *base, const char *path, int len, std::string *out){
+	if (len <= 0 || path[0] == '/' || memchr(path, 0, len)){
+		return false;
+	}
+	for (int i=0;i<len;){
+		int j = i;
+		while (j < len && path[j] != '/'){
+			j++;
+		}
+		if (j-i == 2 && path[i] == '.' && path[i+1] == '.'){
+			return false;
+		}
+		i = j+1;
+	}
+	out->assign(base);
+	out->push_back('/');
+	out->append(path, len);
+	return true;
+}
@@ -0,0 +1,111 @@
+#include "server.h"
+
+// Stored values carry a one byte header followed by an optional expiration
+// and the payload.
+//
+//   0x00 <payload>
+//   0x01 <expires:8 bytes big endian unix ms> <payload>
+//   0x02 <value log pointer>
+//   0x03 <expires> <value log pointer>
+//   0x04                              a hash, the fields are in hashcf
+//   0x05 <expires>                    a hash that expires
+//
+// Values written before the header existed don't start with a valid header
+// and are returned as-is.
+const int RECORD_EXPIRES = 0x01;
+const int RECORD_VLOG = 0x02;
+const int RECORD_HASH = 0x04;
+
+int64_t now_ms(){
+	struct timespec spec;
+	clock_gettime(CLOCK_REALTIME, &spec);
+	return (int64_t)spec.tv_sec*1000+spec.tv_nsec/1000000;
+}
+
+static void encode(std::string *out, int flags, const char *data, int len,
+		int64_t expires
+){
+	out->clear();
+	if (expires){
+		out->reserve(len+9);
+		out->push_back(flags|RECORD_EXPIRES);
+		for (int i=7;i>=0;i--){
+			out->push_back((char)(expires>>(i*8)));
+		}
+	}else{
+		out->reserve(len+1);
+		out->push_back(flags);
+	}
+	out->append(data, len);
+}
+
+void record_encode(std::string *out, const char *data, int len, int64_t expires){
+	encode(out, 0, data, len, expires);
+}
+
+// record_encode_hash encodes the record that marks key as a hash.
+void record_encode_hash(std::string *out, int64_t expires){
+	encode(out, RECORD_HASH, "", 0, expires);
+}
+
+// record_reencode encodes r with a new expiration. A value in the value log
+// stays there.
+void record_reencode(std::string *out, const record *r, int64_t expires){
+	int flags = r->vlog ? RECORD_VLOG : 0;
+	if (r->hash){
+		flags |= RECORD_HASH;
+	}
+	encode(out, flags, r->data, r->len, expires);
+}
+
+void record_decode(const char *data, int len, record *v){
+	v->expires = 0;
+	v->data = data;
+	v->len = len;
+	v->vlog = 0;
+	v->hash = 0;
+	if (len == 0){
+		return;
+	}
+	int flags = (unsigned char)data[0];
+	int hdr = flags&RECORD_EXPIRES ? 9 : 1;
+	if ((flags & ~(RECORD_EXPIRES|RECORD_VLOG|RECORD_HASH)) || len < hdr ||
+		((flags&RECORD_HASH) && ((flags&RECORD_VLOG) || len != hdr))
+	){
+		// not a header.
+		return;
+	}
+	for (int i=1;i<hdr;i++){
+		v->expires = (v->expires<<8)|(unsigned char)data[i];
+	}
+	v->data = data+hdr;
+	v->len = len-hdr;
+	v->vlog = flags&RECORD_VLOG ? 1 : 0;
+	v->hash = flags&RECORD_HASH ? 1 : 0;
+}
+
+bool record_expired(const record *v, int64_t now){
+	return v->expires && v->expires <= now;
+}
+
+// ttl_filter drops expired values during compaction. The dropped key becomes
+// a deletion so that older versions in lower levels don't reappear.
+class ttl_filter : public rocksdb::CompactionFilter {
+public:
+	virtual bool Filter(int, const rocksdb::Slice &,
+			const rocksdb::Slice &existing_value, std::string *,
+			bool *) const override {
+		record v;
+		record_decode(existing_value.data(), existing_value.size(), &v);
+		return record_expired(&v, now_ms());
+	}
+	virtual const char *Name() const override {
+		return "RocksDBServerTTLFilter";
+	}
+};
+
+static ttl_filter ttl_filter_instance;
+
+const rocksdb::CompactionFilter *ttl_filter_get(){
+	return &ttl_filter_instance;
+}
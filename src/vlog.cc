@@ -0,0 +1,721 @@
+#include "server.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// The value log keeps large string values out of the LSM so compactions don't
+// rewrite them. With --vlog-threshold, a value at least that large is appended
+// to a segment file in <shard>/vlog and the key stores a pointer record
+//
+//   <0x02|expires flag> [expires] <shard:2> <segment:4> <offset:8> <length:4>
+//
+// Segments are append only. Each entry is <key length:4> <value length:4>
+// <key> <value>, so the garbage collector can scan a segment and ask the LSM
+// which entries are still pointed to. Segments that are mostly garbage have
+// their live entries copied to a new segment and are removed.
+//
+// A collected segment is retired rather than removed right away. Snapshots
+// (SCAN cursors, EXEC, parallel KEYS) and the WAL batches that replicas are
+// still to be sent may point into it, so it's only removed once no snapshot
+// and no replica is older than the write that moved its entries away.
+//
+// INCR and APPEND on a value in the log are applied by reading and writing
+// the whole value, so merge operands never pile up on top of a pointer and a
+// Get always tells whether an entry is live.
+int64_t vlog_threshold = 0;
+
+const int VLOG_PTR_SIZE = 18;
+const uint64_t VLOG_SEGMENT_SIZE = 64*1024*1024;
+const int VLOG_GC_INTERVAL_MS = 10*1000;
+// segments are rechecked at most this often.
+const uint64_t VLOG_GC_RECHECK_MS = 60*1000;
+// segments with less live data than this are rewritten.
+const double VLOG_GC_LIVE_RATIO = 0.5;
+
+typedef struct segment_t {
+	uint32_t id;
+	int fd;
+	uint64_t size;
+	uint64_t checked;	// when the collector last looked at it
+	bool retired;		// collected, waiting for older readers to go away
+	uint64_t retired_seq;	// sequence of the shard when it was collected
+	std::string path;
+	~segment_t(){
+		close(fd);
+	}
+} segment;
+
+typedef struct vlog_t {
+	std::string path;
+	std::map<uint32_t, std::shared_ptr<segment> > segs;
+	std::shared_ptr<segment> active;
+	uint32_t next_id;
+	// batches before this sequence may point into removed segments.
+	uint64_t gone_seq;
+} vlog;
+
+// the logs are read from RocksDB's threads by the merge operator, and by the
+// collector, so the segment maps are guarded by mu.
+static std::mutex mu;
+static std::vector<vlog*> vlogs;
+
+typedef struct relocation_t {
+	std::string key;
+	uint64_t from;
+	uint64_t to;
+	uint32_t len;
+} relocation;
+
+typedef struct gc_job_t {
+	uv_work_t req;
+	int shard;
+	std::shared_ptr<segment> seg;
+	uint32_t out_id;
+	std::shared_ptr<segment> out;
+	uint64_t live;
+	std::vector<relocation> moves;
+	std::string err;
+} gc_job;
+
+static uv_timer_t gc_timer;
+static gc_job *gc_current = NULL;
+// segments that were collected while a save was linking the log.
+static std::vector<std::string> doomed;
+static uint64_t gc_runs = 0;
+static uint64_t gc_reclaimed = 0;
+
+static void put32(char *p, uint32_t n){
+	for (int i=0;i<4;i++){
+		p[i] = (char)(n>>((3-i)*8));
+	}
+}
+
+static void put64(char *p, uint64_t n){
+	for (int i=0;i<8;i++){
+		p[i] = (char)(n>>((7-i)*8));
+	}
+}
+
+static uint64_t get_be(const char *p, int n){
+	uint64_t v = 0;
+	for (int i=0;i<n;i++){
+		v = (v<<8)|(unsigned char)p[i];
+	}
+	return v;
+}
+
+static std::string segment_path(vlog *v, uint32_t id){
+	char name[32];
+	sprintf(name, "/%06u.vlog", id);
+	return v->path+name;
+}
+
+static std::shared_ptr<segment> open_segment(vlog *v, uint32_t id, int flags){
+	std::shared_ptr<segment> seg(new segment());
+	seg->id = id;
+	seg->path = segment_path(v, id);
+	seg->fd = open(seg->path.c_str(), flags, 0644);
+	if (seg->fd < 0){
+		err(1, "%s", seg->path.c_str());
+	}
+	struct stat st;
+	if (fstat(seg->fd, &st)){
+		err(1, "%s", seg->path.c_str());
+	}
+	seg->size = st.st_size;
+	seg->checked = uv_now(loop);
+	seg->retired = false;
+	seg->retired_seq = 0;
+	return seg;
+}
+
+// vlog_open opens the value log of a shard. New values always go to a new
+// segment, a torn write at the end of an old one is never appended to.
+void vlog_open(int shard, const std::string &shard_dir){
+	vlog *v = new vlog();
+	v->path = shard_dir+"/vlog";
+	v->next_id = 1;
+	v->gone_seq = 0;
+	if (!inmem){
+		DIR *d = opendir(v->path.c_str());
+		struct dirent *ent;
+		while (d && (ent = readdir(d))){
+			unsigned id;
+			char ext[8];
+			if (sscanf(ent->d_name, "%u.%7s", &id, ext) == 2 &&
+				!strcmp(ext, "vlog")){
+				v->segs[id] = open_segment(v, id, O_RDONLY);
+				if (id >= v->next_id){
+					v->next_id = id+1;
+				}
+			}
+		}
+		if (d){
+			closedir(d);
+		}
+	}
+	std::lock_guard<std::mutex> lock(mu);
+	if ((int)vlogs.size() <= shard){
+		vlogs.resize(shard+1);
+	}
+	vlogs[shard] = v;
+}
+
+void vlog_close(){
+	std::lock_guard<std::mutex> lock(mu);
+	for (size_t i=0;i<vlogs.size();i++){
+		delete vlogs[i];
+	}
+	vlogs.clear();
+}
+
+// vlog_in_use returns true when values may be in the log.
+bool vlog_in_use(){
+	if (vlog_threshold > 0){
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(mu);
+	for (size_t i=0;i<vlogs.size();i++){
+		if (vlogs[i] && vlogs[i]->segs.size()){
+			return true;
+		}
+	}
+	return false;
+}
+
+static void write_all(int fd, const char *data, size_t n, uint64_t offset,
+		const std::string &path
+){
+	while (n > 0){
+		ssize_t w = pwrite(fd, data, n, offset);
+		if (w < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			err(1, "%s", path.c_str());
+		}
+		data += w;
+		n -= w;
+		offset += w;
+	}
+}
+
+// append adds an entry to seg and returns the offset of the value.
+static uint64_t append(std::shared_ptr<segment> seg, const rocksdb::Slice &key,
+		const char *value, uint32_t len
+){
+	char hdr[8];
+	put32(hdr, key.size());
+	put32(hdr+4, len);
+	std::string entry;
+	entry.reserve(8+key.size()+len);
+	entry.append(hdr, 8);
+	entry.append(key.data(), key.size());
+	entry.append(value, len);
+	uint64_t offset = seg->size;
+	write_all(seg->fd, entry.data(), entry.size(), offset, seg->path);
+	seg->size += entry.size();
+	return offset+8+key.size();
+}
+
+static void encode_ptr(std::string *out, int64_t expires, int shard,
+		uint32_t id, uint64_t offset, uint32_t len
+){
+	char ptr[VLOG_PTR_SIZE];
+	ptr[0] = (char)(shard>>8);
+	ptr[1] = (char)shard;
+	put32(ptr+2, id);
+	put64(ptr+6, offset);
+	put32(ptr+14, len);
+	record r;
+	r.expires = expires;
+	r.data = ptr;
+	r.len = VLOG_PTR_SIZE;
+	r.vlog = 1;
+	r.hash = 0;
+	record_reencode(out, &r, expires);
+}
+
+// vlog_separate moves the payload of a large record to the log and sets out
+// to the pointer record to store instead. Returns false when the record stays
+// as it is.
+bool vlog_separate(int shard, const rocksdb::Slice &key,
+		const rocksdb::Slice &value, std::string *out
+){
+	if (vlog_threshold <= 0 || inmem){
+		return false;
+	}
+	record r;
+	record_decode(value.data(), value.size(), &r);
+	if (r.vlog || r.len < vlog_threshold){
+		return false;
+	}
+	vlog *v = vlogs[shard];
+	if (!v->active || v->active->size >= VLOG_SEGMENT_SIZE){
+		if (v->segs.empty() && mkdir(v->path.c_str(), 0755) && errno != EEXIST){
+			err(1, "%s", v->path.c_str());
+		}
+		std::shared_ptr<segment> seg = open_segment(v, v->next_id++,
+			O_RDWR|O_CREAT|O_TRUNC);
+		std::lock_guard<std::mutex> lock(mu);
+		v->segs[seg->id] = seg;
+		v->active = seg;
+	}
+	uint64_t offset = append(v->active, key, r.data, r.len);
+	if (!nosync && fdatasync(v->active->fd)){
+		err(1, "%s", v->active->path.c_str());
+	}
+	encode_ptr(out, r.expires, shard, v->active->id, offset, r.len);
+	return true;
+}
+
+static bool parse_ptr(const record *r, int *shard, uint32_t *id,
+		uint64_t *offset, uint32_t *len
+){
+	if (!r->vlog || r->len != VLOG_PTR_SIZE){
+		return false;
+	}
+	*shard = get_be(r->data, 2);
+	*id = get_be(r->data+2, 4);
+	*offset = get_be(r->data+6, 8);
+	*len = get_be(r->data+14, 4);
+	return true;
+}
+
+// vlog_resolve reads the payload of a pointer record into buf and points r
+// at it. Returns false when it's not in the log anymore.
+bool vlog_resolve(record *r, std::string *buf){
+	if (!r->vlog){
+		return true;
+	}
+	int shard;
+	uint32_t id, len;
+	uint64_t offset;
+	if (!parse_ptr(r, &shard, &id, &offset, &len)){
+		return false;
+	}
+	std::shared_ptr<segment> seg;
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		if (shard >= (int)vlogs.size() || !vlogs[shard]){
+			return false;
+		}
+		auto it = vlogs[shard]->segs.find(id);
+		if (it == vlogs[shard]->segs.end()){
+			return false;
+		}
+		seg = it->second;
+	}
+	buf->resize(len);
+	size_t n = 0;
+	while (n < len){
+		ssize_t rd = pread(seg->fd, &(*buf)[n], len-n, offset+n);
+		if (rd < 0 && errno == EINTR){
+			continue;
+		}
+		if (rd <= 0){
+			return false;
+		}
+		n += rd;
+	}
+	r->data = buf->data();
+	r->len = len;
+	r->vlog = 0;
+	return true;
+}
+
+// vlog_length returns the length of the payload of a pointer record without
+// reading it, or -1 when r isn't a valid pointer.
+int64_t vlog_length(const record *r){
+	int shard;
+	uint32_t id, len;
+	uint64_t offset;
+	if (!parse_ptr(r, &shard, &id, &offset, &len)){
+		return -1;
+	}
+	return len;
+}
+
+// inline_handler copies a batch with the pointers replaced by the values.
+class inline_handler : public rocksdb::WriteBatch::Handler {
+	rocksdb::ColumnFamilyHandle *cf(uint32_t id){
+		return id == 0 ? NULL : hashcf;
+	}
+public:
+	rocksdb::WriteBatch *out;
+	bool ok;
+	virtual rocksdb::Status PutCF(uint32_t id, const rocksdb::Slice &key,
+			const rocksdb::Slice &value) override {
+		record r;
+		record_decode(value.data(), value.size(), &r);
+		if (id != 0 || !r.vlog){
+			out->Put(cf(id), key, value);
+			return rocksdb::Status::OK();
+		}
+		std::string buf, rec;
+		if (!vlog_resolve(&r, &buf)){
+			ok = false;
+			return rocksdb::Status::NotFound();
+		}
+		record_encode(&rec, r.data, r.len, r.expires);
+		out->Put(key, rec);
+		return rocksdb::Status::OK();
+	}
+	virtual rocksdb::Status DeleteCF(uint32_t id,
+			const rocksdb::Slice &key) override {
+		out->Delete(cf(id), key);
+		return rocksdb::Status::OK();
+	}
+	virtual rocksdb::Status MergeCF(uint32_t id, const rocksdb::Slice &key,
+			const rocksdb::Slice &value) override {
+		out->Merge(cf(id), key, value);
+		return rocksdb::Status::OK();
+	}
+};
+
+// vlog_inline copies a batch with the values from the log in place of the
+// pointers, for replicas. Returns false when a value is gone from the log.
+bool vlog_inline(rocksdb::WriteBatch *in, rocksdb::WriteBatch *out){
+	inline_handler handler;
+	handler.out = out;
+	handler.ok = true;
+	in->Iterate(&handler);
+	return handler.ok;
+}
+
+// vlog_link hard links the segments of a shard into a checkpoint of it. The
+// collector doesn't remove segments while a save is running.
+rocksdb::Status vlog_link(int shard, const std::string &shard_dir){
+	std::vector<std::string> paths;
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		vlog *v = vlogs[shard];
+		for (auto it=v->segs.begin();it!=v->segs.end();it++){
+			paths.push_back(it->second->path);
+		}
+	}
+	if (paths.empty()){
+		return rocksdb::Status::OK();
+	}
+	std::string dst = shard_dir+"/vlog";
+	if (mkdir(dst.c_str(), 0755)){
+		return rocksdb::Status::IOError(dst, strerror(errno));
+	}
+	for (size_t i=0;i<paths.size();i++){
+		std::string name = paths[i].substr(paths[i].rfind('/'));
+		if (link(paths[i].c_str(), (dst+name).c_str())){
+			return rocksdb::Status::IOError(dst+name, strerror(errno));
+		}
+	}
+	return rocksdb::Status::OK();
+}
+
+// --- garbage collection ---
+
+static bool read_all(int fd, char *buf, size_t n, uint64_t offset){
+	while (n > 0){
+		ssize_t rd = pread(fd, buf, n, offset);
+		if (rd < 0 && errno == EINTR){
+			continue;
+		}
+		if (rd <= 0){
+			return false;
+		}
+		buf += rd;
+		n -= rd;
+		offset += rd;
+	}
+	return true;
+}
+
+// on_gc_work scans a segment and, when it's mostly garbage, copies the live
+// entries to a new segment. The pointers are switched over on the loop.
+static void on_gc_work(uv_work_t *req){
+	gc_job *job = (gc_job*)req->data;
+	rocksdb::DB *db = shards[job->shard].db;
+	std::shared_ptr<segment> seg = job->seg;
+	std::vector<std::pair<std::string, uint64_t> > live;
+	std::vector<uint32_t> lens;
+	uint64_t pos = 0;
+	std::string key, raw;
+	while (pos+8 <= seg->size){
+		char hdr[8];
+		if (!read_all(seg->fd, hdr, 8, pos)){
+			break;
+		}
+		uint32_t klen = get_be(hdr, 4), vlen = get_be(hdr+4, 4);
+		if (pos+8+klen+vlen > seg->size){
+			// a torn entry at the end.
+			break;
+		}
+		key.resize(klen);
+		if (klen && !read_all(seg->fd, &key[0], klen, pos+8)){
+			break;
+		}
+		uint64_t offset = pos+8+klen;
+		pos = offset+vlen;
+		rocksdb::Status s = db->Get(rocksdb::ReadOptions(), key, &raw);
+		if (!s.ok()){
+			continue;
+		}
+		record r;
+		record_decode(raw.data(), raw.size(), &r);
+		int shard;
+		uint32_t id, len;
+		uint64_t off;
+		if (parse_ptr(&r, &shard, &id, &off, &len) && id == seg->id &&
+			off == offset){
+			live.push_back(std::make_pair(key, offset));
+			lens.push_back(vlen);
+			job->live += vlen;
+		}
+	}
+	if (seg->size && (double)job->live/seg->size >= VLOG_GC_LIVE_RATIO){
+		return;
+	}
+	if (live.empty()){
+		return;
+	}
+	// the log isn't closed while the collector runs.
+	job->out.reset(new segment());
+	job->out->id = job->out_id;
+	job->out->path = segment_path(vlogs[job->shard], job->out_id);
+	job->out->fd = open(job->out->path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+	job->out->size = 0;
+	job->out->checked = 0;
+	job->out->retired = false;
+	job->out->retired_seq = 0;
+	if (job->out->fd < 0){
+		job->err = strerror(errno);
+		job->out.reset();
+		return;
+	}
+	std::string value;
+	for (size_t i=0;i<live.size();i++){
+		value.resize(lens[i]);
+		if (lens[i] && !read_all(seg->fd, &value[0], lens[i], live[i].second)){
+			job->err = "read error";
+			return;
+		}
+		relocation m;
+		m.key = live[i].first;
+		m.from = live[i].second;
+		m.len = lens[i];
+		m.to = append(job->out, m.key, value.data(), lens[i]);
+		job->moves.push_back(m);
+	}
+	if (fdatasync(job->out->fd)){
+		job->err = strerror(errno);
+	}
+}
+
+static void remove_segment(const std::string &path){
+	if (save_in_progress()){
+		doomed.push_back(path);
+	}else if (unlink(path.c_str())){
+		log('#', "Could not remove %s: %s", path.c_str(), strerror(errno));
+	}
+}
+
+static void on_gc_work_done(uv_work_t *req, int){
+	gc_job *job = (gc_job*)req->data;
+	gc_current = NULL;
+	vlog *v = vlogs[job->shard];
+	std::shared_ptr<segment> seg = job->seg;
+	bool collect = !seg->size ||
+		(double)job->live/seg->size < VLOG_GC_LIVE_RATIO;
+	if (job->err.size()){
+		log('#', "Value log GC of %s failed: %s", seg->path.c_str(),
+			job->err.c_str());
+		if (job->out){
+			unlink(job->out->path.c_str());
+		}
+		delete job;
+		return;
+	}
+	if (!collect){
+		delete job;
+		return;
+	}
+	if (job->out){
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			v->segs[job->out->id] = job->out;
+		}
+		// only the entries that still point to the old place move, the
+		// others were written over while the collector was copying.
+		rocksdb::WriteBatch batch;
+		std::string raw, ptr;
+		for (size_t i=0;i<job->moves.size();i++){
+			relocation &m = job->moves[i];
+			rocksdb::Status s = shards[job->shard].db->Get(rocksdb::ReadOptions(),
+				m.key, &raw);
+			if (!s.ok()){
+				continue;
+			}
+			record r;
+			record_decode(raw.data(), raw.size(), &r);
+			int shard;
+			uint32_t id, len;
+			uint64_t off;
+			if (!parse_ptr(&r, &shard, &id, &off, &len) || id != seg->id ||
+				off != m.from){
+				continue;
+			}
+			encode_ptr(&ptr, r.expires, job->shard, job->out->id, m.to, m.len);
+			batch.Put(m.key, ptr);
+		}
+		if (batch.Count()){
+			rocksdb::WriteOptions options;
+			options.sync = !nosync;
+			rocksdb::Status s = shards[job->shard].db->Write(options, &batch);
+			if (!s.ok()){
+				err(1, "%s", s.ToString().c_str());
+			}
+		}
+	}
+	// removed by release_retired once nothing reads it anymore.
+	seg->retired = true;
+	seg->retired_seq = shards[job->shard].db->GetLatestSequenceNumber();
+	gc_runs++;
+	gc_reclaimed += seg->size-(job->out ? job->out->size : 0);
+	log('*', "Value log GC reclaimed %s, %llu of %llu bytes live",
+		seg->path.c_str(), (unsigned long long)job->live,
+		(unsigned long long)seg->size);
+	delete job;
+}
+
+// vlog_busy returns true while the collector is running, the database can't
+// be closed then.
+bool vlog_busy(){
+	return gc_current != NULL;
+}
+
+// release_retired removes the retired segments that no snapshot and no
+// replica can read anymore.
+static void release_retired(){
+	for (size_t i=0;i<vlogs.size();i++){
+		vlog *v = vlogs[i];
+		uint64_t held = db_oldest_snapshot(i);
+		uint64_t next = repl_oldest_seq(i);
+		if (next && next-1 < held){
+			held = next-1;
+		}
+		std::vector<std::shared_ptr<segment> > gone;
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			for (auto it=v->segs.begin();it!=v->segs.end();){
+				if (it->second->retired && it->second->retired_seq <= held){
+					gone.push_back(it->second);
+					it = v->segs.erase(it);
+				}else{
+					it++;
+				}
+			}
+		}
+		for (size_t j=0;j<gone.size();j++){
+			if (gone[j]->retired_seq > v->gone_seq){
+				v->gone_seq = gone[j]->retired_seq;
+			}
+			remove_segment(gone[j]->path);
+		}
+	}
+}
+
+// vlog_gone_seq returns the sequence of shard before which WAL batches may
+// point to segments that were removed, a replica behind it needs a full sync.
+uint64_t vlog_gone_seq(int shard){
+	if (shard >= (int)vlogs.size() || !vlogs[shard]){
+		return 0;
+	}
+	return vlogs[shard]->gone_seq;
+}
+
+// vlog_mark_gone records that a batch before seq couldn't be inlined.
+void vlog_mark_gone(int shard, uint64_t seq){
+	if (shard < (int)vlogs.size() && vlogs[shard] && seq > vlogs[shard]->gone_seq){
+		vlogs[shard]->gone_seq = seq;
+	}
+}
+
+// on_gc_timer starts a collection of the segment that was checked the
+// longest ago, unless it was checked recently.
+static void on_gc_timer(uv_timer_t *){
+	if (gc_current || save_in_progress() || ingest_in_progress()){
+		return;
+	}
+	for (size_t i=0;i<doomed.size();i++){
+		unlink(doomed[i].c_str());
+	}
+	doomed.clear();
+	release_retired();
+	uint64_t now = uv_now(loop);
+	int shard = -1;
+	std::shared_ptr<segment> seg;
+	for (size_t i=0;i<vlogs.size();i++){
+		vlog *v = vlogs[i];
+		for (auto it=v->segs.begin();it!=v->segs.end();it++){
+			if (it->second == v->active || it->second->retired){
+				continue;
+			}
+			if (!seg || it->second->checked < seg->checked){
+				seg = it->second;
+				shard = i;
+			}
+		}
+	}
+	if (!seg || now-seg->checked < VLOG_GC_RECHECK_MS){
+		return;
+	}
+	seg->checked = now;
+	gc_job *job = new gc_job();
+	job->req.data = job;
+	job->shard = shard;
+	job->seg = seg;
+	job->out_id = vlogs[shard]->next_id++;
+	job->live = 0;
+	gc_current = job;
+	uv_queue_work(loop, &job->req, on_gc_work, on_gc_work_done);
+}
+
+void vlog_init(){
+	uv_timer_init(loop, &gc_timer);
+	uv_timer_start(&gc_timer, on_gc_timer, VLOG_GC_INTERVAL_MS,
+		VLOG_GC_INTERVAL_MS);
+}
+
+void vlog_info(std::string *out){
+	uint64_t nsegs = 0, bytes = 0, retired = 0;
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		for (size_t i=0;i<vlogs.size();i++){
+			for (auto it=vlogs[i]->segs.begin();it!=vlogs[i]->segs.end();it++){
+				nsegs++;
+				bytes += it->second->size;
+				if (it->second->retired){
+					retired++;
+				}
+			}
+		}
+	}
+	char buf[256];
+	snprintf(buf, sizeof(buf),
+		"# Vlog\r\n"
+		"vlog_threshold:%lld\r\n"
+		"vlog_segments:%llu\r\n"
+		"vlog_bytes:%llu\r\n"
+		"vlog_retired_segments:%llu\r\n"
+		"vlog_gc_in_progress:%d\r\n"
+		"vlog_gc_runs:%llu\r\n"
+		"vlog_gc_reclaimed_bytes:%llu\r\n",
+		(long long)vlog_threshold, (unsigned long long)nsegs,
+		(unsigned long long)bytes, (unsigned long long)retired,
+		gc_current ? 1 : 0,
+		(unsigned long long)gc_runs, (unsigned long long)gc_reclaimed);
+	out->append(buf);
+}
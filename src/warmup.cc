@@ -0,0 +1,127 @@
+#include "server.h"
+#include <algorithm>
+
+// The server keeps a sample of the keys that are read, one in eight reads
+// goes into a ring of --warmup-keys entries. A clean shutdown writes them to
+// WARMUP in the data directory, and the next start reads them back on the
+// thread pool, in key order, which brings their blocks into the block cache
+// and the page cache while connections are already being served.
+//
+// The file holds <length:4> <'s'|'h'> <key> for every key, 's' for string
+// keys and 'h' for hash fields.
+int warmup_keys = 100000;
+
+static std::vector<std::string> hot;
+static size_t hot_next = 0;
+static unsigned hot_sample = 0;
+
+typedef struct warmup_job_t {
+	uv_work_t req;
+	std::vector<std::string> keys;
+	uint64_t start;
+} warmup_job;
+
+static warmup_job *warmup_current = NULL;
+
+bool warmup_in_progress(){
+	return warmup_current != NULL;
+}
+
+static std::string warmup_path(){
+	return std::string(dir)+"/WARMUP";
+}
+
+// warmup_touch samples a key that was read.
+void warmup_touch(rocksdb::ColumnFamilyHandle *cf, const rocksdb::Slice &key){
+	if (warmup_keys <= 0 || (++hot_sample & 7)){
+		return;
+	}
+	std::string entry;
+	entry.reserve(key.size()+1);
+	entry.push_back(cf ? 'h' : 's');
+	entry.append(key.data(), key.size());
+	if (hot.size() < (size_t)warmup_keys){
+		hot.push_back(entry);
+	}else{
+		hot[hot_next].swap(entry);
+		hot_next = (hot_next+1)%warmup_keys;
+	}
+}
+
+// warmup_save writes the sampled keys for the next start.
+void warmup_save(){
+	if (inmem || hot.empty()){
+		return;
+	}
+	std::sort(hot.begin(), hot.end());
+	hot.erase(std::unique(hot.begin(), hot.end()), hot.end());
+	std::string path = warmup_path();
+	std::string tmp = path+".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f){
+		log('#', "Could not write %s: %s", tmp.c_str(), strerror(errno));
+		return;
+	}
+	for (size_t i=0;i<hot.size();i++){
+		unsigned char n[4];
+		uint32_t len = hot[i].size();
+		n[0] = len>>24; n[1] = len>>16; n[2] = len>>8; n[3] = len;
+		fwrite(n, 1, 4, f);
+		fwrite(hot[i].data(), 1, len, f);
+	}
+	if (fclose(f) || rename(tmp.c_str(), path.c_str())){
+		log('#', "Could not write %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	log('*', "Saved %zu keys for the cache warmup", hot.size());
+}
+
+static void on_warmup_work(uv_work_t *req){
+	warmup_job *job = (warmup_job*)req->data;
+	for (size_t i=0;i<job->keys.size();i++){
+		const std::string &k = job->keys[i];
+		db_prefetch(k[0] == 'h' ? hashcf : NULL,
+			rocksdb::Slice(k.data()+1, k.size()-1));
+	}
+}
+
+static void on_warmup_work_done(uv_work_t *req, int){
+	warmup_job *job = (warmup_job*)req->data;
+	warmup_current = NULL;
+	log('*', "Cache warmup read %zu keys in %llu ms", job->keys.size(),
+		(unsigned long long)(uv_now(loop)-job->start));
+	delete job;
+}
+
+// warmup_init starts reading the keys that the last run saved. The file is
+// removed, it only describes the cache of that run.
+void warmup_init(){
+	if (inmem || warmup_keys <= 0){
+		return;
+	}
+	std::string path = warmup_path();
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f){
+		return;
+	}
+	warmup_job *job = new warmup_job();
+	unsigned char n[4];
+	while (fread(n, 1, 4, f) == 4){
+		uint32_t len = (n[0]<<24)|(n[1]<<16)|(n[2]<<8)|n[3];
+		std::string k(len, 0);
+		if (len < 1 || fread(&k[0], 1, len, f) != len){
+			break;
+		}
+		job->keys.push_back(k);
+	}
+	fclose(f);
+	unlink(path.c_str());
+	if (job->keys.empty()){
+		delete job;
+		return;
+	}
+	job->req.data = job;
+	job->start = uv_now(loop);
+	warmup_current = job;
+	uv_queue_work(loop, &job->req, on_warmup_work, on_warmup_work_done);
+}